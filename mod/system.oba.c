@@ -11,6 +11,11 @@ const char* systemModSource =
     "return None()\n"
     "}\n"
     "\n"
+    "fn flush {\n"
+    "__native_flush()\n"
+    "return None()\n"
+    "}\n"
+    "\n"
     "fn readByte {\n"
     "let byte = __native_read_byte()\n"
     "if __native_is_nil(byte) {\n"
@@ -32,6 +32,33 @@ ObaInterpretResult obaInterpret(ObaVM* vm, const char* source);
 // Triggers a garbage-collection in the VM.
 void obaCollectGarbage(ObaVM* vm);
 
+// Sets the number of objects that each slice of an incremental collection
+// marks or sweeps. Slices run between allocations, so smaller budgets mean
+// shorter pauses, at the cost of collections that take longer to finish. The
+// default is 10000.
+void obaSetGCSliceBudget(ObaVM* vm, int objects);
+
+// Sets the number of threads that mark objects during a collection, including
+// the thread running the VM. With 1, the VM marks on its own thread only. The
+// default is the number of cores, up to 8.
+void obaSetMarkerThreads(ObaVM* vm, int threads);
+
+// Sets the maximum number of nested function calls. Calls beyond this depth
+// fail with a runtime error. The default is about a million.
+void obaSetMaxFrames(ObaVM* vm, int maxFrames);
+
+// Enables or disables compiling hot functions to machine code. The JIT is
+// enabled by default in builds that include it.
+void obaEnableJit(ObaVM* vm, bool enabled);
+
+// Enables or disables writing /tmp/perf-<pid>.map, which lets profilers such
+// as perf symbolize the machine code generated by the JIT.
+void obaEnablePerfMap(ObaVM* vm, bool enabled);
+
+// Writes the output that the VM has buffered to stdout. Output is flushed
+// automatically when [obaInterpret] returns.
+void obaFlushOutput(ObaVM* vm);
+
 void obaErrorf(ObaVM* vm, const char* format, ...);
 void obaArityError(ObaVM* vm, int want, int got);
 void obaTypeError(ObaVM* vm, const char* expected);
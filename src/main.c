@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <oba.h>
 
@@ -11,6 +12,13 @@
 
 #define PROMPT ">> "
 
+#define USAGE "Usage: oba [--no-jit] [--perf-map] [--gc-threads n] [path]\n"
+
+// Options set from the command line.
+static bool jitEnabled = true;
+static bool perfMapEnabled = false;
+static int gcThreads = 0;
+
 static char* read(void) {
   char* line = NULL;
   ssize_t bufsize = 0; // have getline allocate a buffer for us
@@ -27,6 +35,14 @@ static char* read(void) {
   return line;
 }
 
+static ObaVM* newVM(void) {
+  ObaVM* vm = obaNewVM(NULL, 0);
+  obaEnableJit(vm, jitEnabled);
+  obaEnablePerfMap(vm, perfMapEnabled);
+  if (gcThreads > 0) obaSetMarkerThreads(vm, gcThreads);
+  return vm;
+}
+
 static ObaInterpretResult interpret(ObaVM* vm, char* input) {
   ObaInterpretResult result = obaInterpret(vm, input);
   return result;
@@ -39,7 +55,7 @@ static void repl(void) {
   // Print banner.
   printf("oba %s\n", OBA_VERSION_STRING);
   printf("Press ctrl+d to exit\n");
-  ObaVM* vm = obaNewVM(NULL, 0);
+  ObaVM* vm = newVM();
 
   do {
     printf(PROMPT);
@@ -81,7 +97,7 @@ static char* readFile(const char* filename) {
 
 static void runFile(const char* filename) {
   char* source = readFile(filename);
-  ObaVM* vm = obaNewVM(NULL, 0);
+  ObaVM* vm = newVM();
   ObaInterpretResult result = interpret(vm, source);
   free(source);
   obaFreeVM(vm);
@@ -91,13 +107,27 @@ static void runFile(const char* filename) {
 }
 
 int main(int argc, char** argv) {
-  if (argc == 1) {
+  const char* path = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--no-jit") == 0) {
+      jitEnabled = false;
+    } else if (strcmp(argv[i], "--perf-map") == 0) {
+      perfMapEnabled = true;
+    } else if (strcmp(argv[i], "--gc-threads") == 0 && i + 1 < argc &&
+               atoi(argv[i + 1]) > 0) {
+      gcThreads = atoi(argv[++i]);
+    } else if (argv[i][0] != '-' && path == NULL) {
+      path = argv[i];
+    } else {
+      fprintf(stderr, USAGE);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (path == NULL) {
     repl();
-  } else if (argc == 2) {
-    runFile(argv[1]);
   } else {
-    fprintf(stderr, "Usage: oba [path]\n");
-    exit(EXIT_FAILURE);
+    runFile(path);
   }
   return EXIT_SUCCESS;
 }
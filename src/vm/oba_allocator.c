@@ -0,0 +1,195 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "oba_allocator.h"
+#include "oba_common.h"
+
+// The size and alignment of a page. Pages are aligned to their size so the
+// page of a slot can be found by masking its address.
+#define PAGE_SIZE (64 * 1024)
+
+// The alignment of every slot.
+#define SLOT_ALIGN 16
+
+typedef struct Slot {
+  struct Slot* next;
+} Slot;
+
+struct Page {
+  // The neighbors of the page in its size class's available list. The empty
+  // list only uses [next].
+  Page* prev;
+  Page* next;
+
+  // The next page in the allocator's list of every page.
+  Page* nextPage;
+
+  // Freed slots, which are reused before [unused].
+  Slot* free;
+
+  // The first slot that has never been allocated. Slots from here to the end
+  // of the page are handed out in order.
+  char* unused;
+
+  int sizeClass;
+  int liveCount;
+  bool isAvailable;
+};
+
+static const size_t slotSizes[ALLOCATOR_CLASS_COUNT] = {
+    16, 32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256,
+};
+
+// The size class of an allocation, indexed by its size in units of SLOT_ALIGN,
+// rounded up.
+static const uint8_t sizeClasses[ALLOCATOR_MAX_SMALL / SLOT_ALIGN + 1] = {
+    0, 0, 1, 2, 3, 4, 5, 6, 7, 8, 8, 9, 9, 10, 10, 11, 11,
+};
+
+#define PAGE_OF(pointer)                                                       \
+  ((Page*)((uintptr_t)(pointer) & ~(uintptr_t)(PAGE_SIZE - 1)))
+
+#define PAGE_START(page)                                                       \
+  ((char*)(page) +                                                             \
+   (sizeof(Page) + SLOT_ALIGN - 1) / SLOT_ALIGN * SLOT_ALIGN)
+
+#define PAGE_END(page) ((char*)(page) + PAGE_SIZE)
+
+// Maps a new page aligned to PAGE_SIZE.
+static Page* mapPage(Allocator* allocator) {
+  // Map twice the size and trim the ends, since mmap only aligns to the OS
+  // page size.
+  char* region = mmap(NULL, PAGE_SIZE * 2, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  // Fail fast if we can't get the requested memory.
+  if (region == MAP_FAILED) exit(1);
+
+  char* start = (char*)PAGE_OF(region + PAGE_SIZE - 1);
+  if (start > region) munmap(region, start - region);
+  munmap(start + PAGE_SIZE, region + PAGE_SIZE - start);
+
+  Page* page = (Page*)start;
+  page->nextPage = allocator->pages;
+  allocator->pages = page;
+  return page;
+}
+
+static void linkAvailable(Allocator* allocator, Page* page) {
+  Page** head = &allocator->available[page->sizeClass];
+  page->prev = NULL;
+  page->next = *head;
+  if (*head != NULL) (*head)->prev = page;
+  *head = page;
+  page->isAvailable = true;
+}
+
+static void unlinkAvailable(Allocator* allocator, Page* page) {
+  if (page->prev != NULL) {
+    page->prev->next = page->next;
+  } else {
+    allocator->available[page->sizeClass] = page->next;
+  }
+  if (page->next != NULL) page->next->prev = page->prev;
+  page->prev = NULL;
+  page->next = NULL;
+  page->isAvailable = false;
+}
+
+// Returns a page for [sizeClass] with every slot free.
+static Page* takePage(Allocator* allocator, int sizeClass) {
+  Page* page = allocator->empty;
+  if (page != NULL) {
+    allocator->empty = page->next;
+  } else {
+    page = mapPage(allocator);
+  }
+
+  page->free = NULL;
+  page->unused = PAGE_START(page);
+  page->sizeClass = sizeClass;
+  page->liveCount = 0;
+  linkAvailable(allocator, page);
+  return page;
+}
+
+// Returns the memory of [page], which has no live slots, to the OS.
+static void releasePage(Allocator* allocator, Page* page) {
+  unlinkAvailable(allocator, page);
+
+  // The header stays resident. The OS refills the rest with zeros when it is
+  // touched again.
+  size_t osPageSize = allocator->osPageSize;
+  char* start = (char*)(((uintptr_t)PAGE_START(page) + osPageSize - 1) &
+                        ~(uintptr_t)(osPageSize - 1));
+  madvise(start, PAGE_END(page) - start, MADV_DONTNEED);
+
+  page->next = allocator->empty;
+  allocator->empty = page;
+}
+
+void initAllocator(Allocator* allocator) {
+  for (int i = 0; i < ALLOCATOR_CLASS_COUNT; i++) {
+    allocator->available[i] = NULL;
+  }
+  allocator->empty = NULL;
+  allocator->pages = NULL;
+  allocator->osPageSize = (size_t)sysconf(_SC_PAGESIZE);
+}
+
+void freeAllocator(Allocator* allocator) {
+  Page* page = allocator->pages;
+  while (page != NULL) {
+    Page* next = page->nextPage;
+    munmap(page, PAGE_SIZE);
+    page = next;
+  }
+  initAllocator(allocator);
+}
+
+void* allocatorAllocate(Allocator* allocator, size_t size) {
+  ASSERT(size > 0 && size <= ALLOCATOR_MAX_SMALL, "Allocation is not small");
+  int sizeClass = sizeClasses[(size + SLOT_ALIGN - 1) / SLOT_ALIGN];
+  size_t slotSize = slotSizes[sizeClass];
+
+  Page* page = allocator->available[sizeClass];
+  if (page == NULL) page = takePage(allocator, sizeClass);
+
+  void* slot;
+  if (page->free != NULL) {
+    slot = page->free;
+    page->free = page->free->next;
+  } else {
+    slot = page->unused;
+    page->unused += slotSize;
+  }
+  page->liveCount++;
+
+  if (page->free == NULL && page->unused + slotSize > PAGE_END(page)) {
+    unlinkAvailable(allocator, page);
+  }
+  return slot;
+}
+
+void allocatorFree(Allocator* allocator, void* pointer, size_t size) {
+  Page* page = PAGE_OF(pointer);
+  ASSERT(page->sizeClass == sizeClasses[(size + SLOT_ALIGN - 1) / SLOT_ALIGN],
+         "Freed with a different size than it was allocated with");
+  (void)size;
+
+  Slot* slot = (Slot*)pointer;
+  slot->next = page->free;
+  page->free = slot;
+  page->liveCount--;
+
+  if (!page->isAvailable) linkAvailable(allocator, page);
+
+  // The class's last available page is kept, so an object allocated and freed
+  // over and over doesn't map and release a page each time.
+  if (page->liveCount == 0 && !(page->prev == NULL && page->next == NULL)) {
+    releasePage(allocator, page);
+  }
+}
@@ -0,0 +1,49 @@
+#ifndef oba_allocator_h
+#define oba_allocator_h
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// The largest allocation served from size-class pages. Larger allocations are
+// left to malloc.
+#define ALLOCATOR_MAX_SMALL 256
+
+// The number of size classes up to ALLOCATOR_MAX_SMALL.
+#define ALLOCATOR_CLASS_COUNT 12
+
+typedef struct Page Page;
+
+// Serves the VM's small allocations from pages that each hold slots of a
+// single size class.
+//
+// Each page keeps a free list of its slots, so allocating is a pointer pop and
+// freeing is a pointer push. Objects freed by a sweep go back onto the free
+// lists of their pages. When a page has no live slots left, its memory is
+// returned to the OS and the page can be reused by any size class, so resident
+// memory shrinks after a spike and fragmentation is bounded by the number of
+// partly used pages.
+typedef struct {
+  // For each size class, the pages that have free slots.
+  Page* available[ALLOCATOR_CLASS_COUNT];
+
+  // Pages with no live slots, whose memory has been returned to the OS.
+  Page* empty;
+
+  // Every page the allocator has mapped.
+  Page* pages;
+
+  size_t osPageSize;
+} Allocator;
+
+void initAllocator(Allocator* allocator);
+
+// Unmaps every page. Slots that are still allocated become invalid.
+void freeAllocator(Allocator* allocator);
+
+// Returns a slot for [size] bytes, which must be at most ALLOCATOR_MAX_SMALL.
+void* allocatorAllocate(Allocator* allocator, size_t size);
+
+// Frees [pointer], which was allocated with [size] bytes.
+void allocatorFree(Allocator* allocator, void* pointer, size_t size);
+
+#endif
@@ -39,6 +39,7 @@ Value __native_sleep(ObaVM* vm, int argc, Value* argv) {
   ASSERT_ARITY(vm, argc, 1);
   Value seconds = argv[0];
   unsigned int remaining = (unsigned int)AS_NUMBER(seconds);
+  obaFlushOutput(vm);
   while (remaining > 0) remaining = sleep(remaining);
   return OBA_NUMBER(0);
 }
@@ -52,11 +53,14 @@ Value __native_read_byte(ObaVM* vm, int argc, Value* argv) {
   ASSERT_ARITY(vm, argc, 0);
   int c;
 
+  // Show any prompt before waiting for input.
+  obaFlushOutput(vm);
+
   if ((c = getchar()) == EOF) {
     return NIL_VAL;
   }
   const char byte = (const char)c;
-  return OBJ_VAL(copyString(vm, &byte, 1));
+  return OBJ_VAL(copyTransientString(vm, &byte, 1));
 }
 
 Value __native_read_line(ObaVM* vm, int argc, Value* argv) {
@@ -65,26 +69,37 @@ Value __native_read_line(ObaVM* vm, int argc, Value* argv) {
   size_t length = 0;
   ssize_t nread;
 
+  obaFlushOutput(vm);
   if ((nread = getline(&line, &length, stdin)) == -1) {
     if (!feof(stdin)) {
       vm->error = OBJ_VAL(copyString(vm, "read", 4));
     }
+    free(line);
     return NIL_VAL;
   }
 
-  return OBJ_VAL(takeString(vm, line, nread));
+  // The line was allocated by getline rather than the VM, so it is copied.
+  ObjString* string = copyTransientString(vm, line, (int)nread);
+  free(line);
+  return OBJ_VAL(string);
 }
 
 Value __native_print(ObaVM* vm, int argc, Value* argv) {
   ASSERT_ARITY(vm, argc, 1);
-  printValue(argv[0]);
+  obaWriteValue(vm, argv[0]);
   return NIL_VAL;
 }
 
 Value __native_println(ObaVM* vm, int argc, Value* argv) {
   ASSERT_ARITY(vm, argc, 1);
-  printValue(argv[0]);
-  printf("\n");
+  obaWriteValue(vm, argv[0]);
+  obaWriteNewline(vm);
+  return NIL_VAL;
+}
+
+Value __native_flush(ObaVM* vm, int argc, Value* argv) {
+  ASSERT_ARITY(vm, argc, 0);
+  obaFlushOutput(vm);
   return NIL_VAL;
 }
 
@@ -98,7 +113,8 @@ Value __native_str(ObaVM* vm, int argc, Value* argv) {
 Value __native_global(ObaVM* vm, int argc, Value* argv) {
   if (vm->allowGlobals) {
     ASSERT_ARITY(vm, argc, 2);
-    tableSet(vm, vm->globals, AS_STRING(argv[0]), argv[1]);
+    ObjString* name = flattenString(vm, AS_STRING(argv[0]));
+    tableSet(vm, vm->globals, name, argv[1]);
   } else {
     obaErrorf(vm, "illegal global definition");
   }
@@ -129,6 +145,7 @@ Builtin __builtins__[] = {
     {"__native_read_line", &__native_read_line},
     {"__native_print", &__native_print},
     {"__native_println", &__native_println},
+    {"__native_flush", &__native_flush},
 
     // VM interaction.
     {"__native_global", &__native_global},
@@ -5,6 +5,10 @@
 #include "oba_chunk.h"
 #include "oba_common.h"
 
+DEFINE_BUFFER(ImportCache, ImportCache)
+DEFINE_BUFFER(MatchArm, MatchArm)
+DEFINE_BUFFER(MatchTable, MatchTable)
+
 void initChunk(Chunk* chunk) {
   memset(chunk, 0, sizeof(Chunk));
   chunk->capacity = 0;
@@ -12,12 +16,22 @@ void initChunk(Chunk* chunk) {
   chunk->code = NULL;
   chunk->lines = NULL;
   initValueBuffer(&chunk->constants);
+  initImportCacheBuffer(&chunk->importCaches);
+  initMatchTableBuffer(&chunk->matchTables);
 }
 
 void freeChunk(ObaVM* vm, Chunk* chunk) {
   FREE_ARRAY(vm, uint8_t, chunk->code, chunk->capacity);
   FREE_ARRAY(vm, int, chunk->lines, chunk->capacity);
   freeValueBuffer(vm, &chunk->constants);
+  freeImportCacheBuffer(vm, &chunk->importCaches);
+  for (int i = 0; i < chunk->matchTables.count; i++) {
+    MatchTable* table = &chunk->matchTables.values[i];
+    freeMatchArmBuffer(vm, &table->arms);
+    FREE_ARRAY(vm, MatchEntry, table->tags, table->tagCount);
+    FREE_ARRAY(vm, MatchEntry, table->literals, table->literalCapacity);
+  }
+  freeMatchTableBuffer(vm, &chunk->matchTables);
   initChunk(chunk);
 }
 
@@ -33,3 +47,18 @@ void writeChunk(ObaVM* vm, Chunk* chunk, uint8_t byte, int line) {
   chunk->lines[chunk->count] = line;
   chunk->count++;
 }
+
+int addImportCache(ObaVM* vm, Chunk* chunk) {
+  ImportCache cache = {NULL, 0};
+  writeImportCacheBuffer(vm, &chunk->importCaches, cache);
+  return chunk->importCaches.count - 1;
+}
+
+int addMatchTable(ObaVM* vm, Chunk* chunk) {
+  MatchTable table;
+  memset(&table, 0, sizeof(MatchTable));
+  table.state = MATCH_UNBUILT;
+  initMatchArmBuffer(&table.arms);
+  writeMatchTableBuffer(vm, &chunk->matchTables, table);
+  return chunk->matchTables.count - 1;
+}
@@ -4,6 +4,79 @@
 #include "oba_value.h"
 #include <stdint.h>
 
+// An inline cache for an instruction that reads a variable from an imported
+// module.
+//
+// The cache remembers the slot the variable was found in the last time the
+// instruction ran, and the module it was found in. As long as the instruction
+// keeps reading from the same module, the variable is loaded directly from its
+// slot instead of being looked up by name.
+typedef struct {
+  ObjModule* module;
+  int slot;
+} ImportCache;
+
+DECLARE_BUFFER(ImportCache, ImportCache);
+
+// An arm of a match expression whose pattern is known without running any
+// code: a constant, or a variable of the module.
+typedef struct {
+  // Whether [index] is the slot of a module variable rather than a constant.
+  bool isVariable;
+  uint8_t index;
+
+  // The number of variables the arm binds to the matched value's fields.
+  int bindingCount;
+
+  // The offset of the arm's body, which runs with the fields on the stack.
+  int body;
+} MatchArm;
+
+DECLARE_BUFFER(MatchArm, MatchArm);
+
+typedef enum {
+  // The dispatch tables have not been built yet.
+  MATCH_UNBUILT,
+
+  // The dispatch tables are ready.
+  MATCH_BUILT,
+
+  // Some pattern can't be dispatched on, so the arms are always tried in
+  // order.
+  MATCH_SEQUENTIAL,
+} MatchState;
+
+// An entry in a match table, mapping a pattern to the first arm it selects.
+typedef struct {
+  Value pattern;
+  int arm;
+} MatchEntry;
+
+// The dispatch tables for an OP_MATCH instruction.
+//
+// These are built from the patterns of the match expression's arms the first
+// time the instruction runs. An instance is dispatched on its constructor's
+// tag, and any other value is looked up in a hash table of the literal
+// patterns, so that selecting an arm does not depend on how many arms come
+// before it. Values the tables can't place, including those no arm matches,
+// fall through to the arms' sequential pattern tests.
+typedef struct {
+  MatchState state;
+  MatchArmBuffer arms;
+
+  // The arm selected by each constructor tag. The pattern is the constructor,
+  // which instances must have to select the arm.
+  MatchEntry* tags;
+  int tagCount;
+
+  // An open-addressing hash table of the literal patterns, whose capacity is
+  // a power of two.
+  MatchEntry* literals;
+  int literalCapacity;
+} MatchTable;
+
+DECLARE_BUFFER(MatchTable, MatchTable);
+
 // Chunk is a dynamic array of Oba bytecode instructions.
 typedef struct {
   int capacity;
@@ -11,6 +84,13 @@ typedef struct {
   uint8_t* code;
   int* lines;
   ValueBuffer constants;
+
+  // The inline caches used by the OP_GET_IMPORTED_VARIABLE instructions in
+  // this chunk.
+  ImportCacheBuffer importCaches;
+
+  // The dispatch tables used by the OP_MATCH instructions in this chunk.
+  MatchTableBuffer matchTables;
 } Chunk;
 
 void initChunk(Chunk*);
@@ -21,4 +101,10 @@ void freeChunk(ObaVM* vm, Chunk*);
 // Writes a byte to the given [Chunk], allocating if necessary.
 void writeChunk(ObaVM* vm, Chunk*, uint8_t, int);
 
+// Adds an empty import cache to the given [Chunk] and returns its index.
+int addImportCache(ObaVM* vm, Chunk*);
+
+// Adds a match table with no arms to the given [Chunk] and returns its index.
+int addMatchTable(ObaVM* vm, Chunk*);
+
 #endif
@@ -1,3 +1,5 @@
+#include <string.h>
+
 #include "oba_common.h"
 #include "oba_vm.h"
 
@@ -6,19 +8,43 @@ void* reallocate(ObaVM* vm, void* pointer, size_t oldSize, size_t newSize) {
 
 #ifdef DEBUG_STRESS_GC
   if (newSize > oldSize) {
-    obaCollectGarbage(vm);
+    obaStepGarbage(vm);
   }
 #else
-  if (newSize > oldSize && vm->bytesAllocated > vm->nextGC) {
-    obaCollectGarbage(vm);
+  if (newSize > oldSize && vm->bytesAllocated > vm->nextGCStep) {
+    obaStepGarbage(vm);
   }
 #endif
 
+  // Small blocks live in the VM's size-class pages and large blocks in malloc,
+  // so a block that crosses ALLOCATOR_MAX_SMALL moves between them.
+  if (pointer != NULL && oldSize <= ALLOCATOR_MAX_SMALL) {
+    void* result = NULL;
+    if (newSize > 0) {
+      result = newSize <= ALLOCATOR_MAX_SMALL
+                   ? allocatorAllocate(&vm->allocator, newSize)
+                   : malloc(newSize);
+      if (result == NULL) exit(1);
+      memcpy(result, pointer, oldSize < newSize ? oldSize : newSize);
+    }
+    allocatorFree(&vm->allocator, pointer, oldSize);
+    return result;
+  }
+
   if (newSize == 0) {
     free(pointer);
     return NULL;
   }
 
+  if (newSize <= ALLOCATOR_MAX_SMALL) {
+    void* result = allocatorAllocate(&vm->allocator, newSize);
+    if (pointer != NULL) {
+      memcpy(result, pointer, newSize);
+      free(pointer);
+    }
+    return result;
+  }
+
   void* result = realloc(pointer, newSize);
 
   // Fail fast if we can't get the requested memory.
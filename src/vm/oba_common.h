@@ -44,8 +44,17 @@
 #define ALLOCATE_OBJ(vm, type, objectType)                                     \
   (type*)allocateObject(vm, sizeof(type), objectType)
 
+// Allocates an object whose struct ends in a flexible array of [count]
+// elements of [elementType].
+#define ALLOCATE_FLEX_OBJ(vm, type, elementType, count, objectType)            \
+  (type*)allocateObject(vm, sizeof(type) + sizeof(elementType) * (count),      \
+                        objectType)
+
 #define FREE(vm, type, pointer) reallocate(vm, pointer, sizeof(type), 0)
 
+#define FREE_FLEX(vm, type, elementType, count, pointer)                       \
+  reallocate(vm, pointer, sizeof(type) + sizeof(elementType) * (count), 0)
+
 // Reallocates [pointer] from [oldSize] to [newSize].
 // If [newSize] is 0, [pointer] is freed.
 void* reallocate(ObaVM* vm, void* pointer, size_t oldSize, size_t newSize);
@@ -18,6 +18,10 @@
 // The maximum number of upvalues that can be closed over in any function scope.
 #define MAX_UPVALUES UINT8_MAX
 
+// The maximum number of top-level variables that can be declared in a module,
+// including the builtins it uses.
+#define MAX_MODULE_VARIABLES (UINT8_MAX + 1)
+
 // The size of the buffer used to format error messages.
 #define MAX_ERROR_SIZE 1024
 
@@ -29,6 +33,14 @@
 // instruction.
 #define MAX_JUMP UINT16_MAX
 
+// The number of recently emitted instructions the peephole optimizer looks at
+// when fusing a sequence of instructions into a single superinstruction.
+#define MAX_FUSED_OPS 3
+
+// The maximum number of calls in the arms of a match expression that can become
+// tail calls. Calls past this limit are made normally.
+#define MAX_TAIL_ARMS UINT8_MAX
+
 // The compiler's view of a local value that is captured by a closure.
 typedef struct {
   // The stack slot of this upvalue.
@@ -43,6 +55,10 @@ typedef struct {
   Token token;
   int depth;
 
+  // The stack slot holding this local, relative to the function's first
+  // argument.
+  int slot;
+
   // Whether this local is captured by an upvalue.
   bool isCaptured;
 } Local;
@@ -80,6 +96,33 @@ struct Compiler {
   int currentDepth;
   Parser* parser;
 
+  // The number of values on the stack at the current point in the function,
+  // counting the function's arguments, and the most there have ever been.
+  int slotCount;
+  int maxSlots;
+
+  // The offsets of the most recently emitted instructions, most recent first.
+  //
+  // These are used by the peephole optimizer to fuse common sequences of
+  // instructions. An offset of -1 means that there is no instruction that can
+  // be fused at that position, either because none has been emitted yet or
+  // because a jump lands between it and the instructions that follow it.
+  int recentOps[MAX_FUSED_OPS];
+
+  // The offsets of the OP_CALL instructions whose results are the value of the
+  // most recently compiled match expression, and the offset just past the end
+  // of that expression. If the match's value is returned immediately, these
+  // become tail calls.
+  int armCalls[MAX_TAIL_ARMS];
+  int armCallCount;
+  int matchEnd;
+
+  // The number of match arms whose bodies are being compiled.
+  int armDepth;
+
+  // The index of the match table for the arms being compiled, or -1.
+  int matchTable;
+
   // A pointer to the VM, used to store objects allocated during compilation.
   ObaVM* vm;
 };
@@ -94,6 +137,12 @@ void initCompiler(ObaVM* vm, Compiler* compiler, Parser* parser,
   compiler->localCount = 0;
   compiler->currentDepth = 0;
   compiler->function = newFunction(vm, parser->module);
+  for (int i = 0; i < MAX_FUSED_OPS; i++) {
+    compiler->recentOps[i] = -1;
+  }
+  compiler->armCallCount = 0;
+  compiler->matchEnd = -1;
+  compiler->matchTable = -1;
 }
 
 static void printError(Compiler* compiler, const char* label,
@@ -145,20 +194,172 @@ ObjFunction* endCompiler(Compiler* compiler, const char* debugName,
 
 // Bytecode -------------------------------------------------------------------
 
+// The stack effect of each instruction.
+static const int stackEffects[] = {
+#define OPCODE(_, effect) effect,
+#include "oba_opcodes.h"
+#undef OPCODE
+};
+
+// Records that the code emitted next runs with [n] more values on the stack.
+static void adjustSlots(Compiler* compiler, int n) {
+  compiler->slotCount += n;
+  if (compiler->slotCount > compiler->maxSlots) {
+    compiler->maxSlots = compiler->slotCount;
+  }
+}
+
 static void emitByte(Compiler* compiler, int byte) {
   writeChunk(compiler->vm, &compiler->function->chunk, byte,
              compiler->parser->currentLine);
 }
 
+// Returns the opcode of the [n]th most recently emitted instruction, or -1 if
+// that instruction cannot be fused with the next one.
+static int recentOp(Compiler* compiler, int n) {
+  int offset = compiler->recentOps[n];
+  if (offset < 0) return -1;
+  return compiler->function->chunk.code[offset];
+}
+
+// Returns the [operand]th operand byte of the [n]th most recently emitted
+// instruction.
+static uint8_t recentOperand(Compiler* compiler, int n, int operand) {
+  return compiler->function->chunk.code[compiler->recentOps[n] + 1 + operand];
+}
+
+// Records that an instruction starts at the end of the chunk.
+static void recordOp(Compiler* compiler) {
+  for (int i = MAX_FUSED_OPS - 1; i > 0; i--) {
+    compiler->recentOps[i] = compiler->recentOps[i - 1];
+  }
+  compiler->recentOps[0] = compiler->function->chunk.count;
+}
+
+// Removes the [n] most recently emitted instructions from the chunk so they can
+// be replaced by a single superinstruction.
+static void discardOps(Compiler* compiler, int n) {
+  compiler->function->chunk.count = compiler->recentOps[n - 1];
+  for (int i = 0; i < MAX_FUSED_OPS; i++) {
+    compiler->recentOps[i] = i + n < MAX_FUSED_OPS ? compiler->recentOps[i + n]
+                                                   : -1;
+  }
+}
+
+// Marks the end of the chunk as the target of a jump.
+//
+// Instructions on either side of a jump target cannot be fused, because the
+// code that jumps here expects to skip the instructions before it.
+static void markJumpTarget(Compiler* compiler) {
+  for (int i = 0; i < MAX_FUSED_OPS; i++) {
+    compiler->recentOps[i] = -1;
+  }
+}
+
+// Attempts to fuse the binary operator [code] with the two instructions that
+// push its operands, when those read a local and either another local or a
+// constant:
+//
+//   GET_LOCAL a, GET_LOCAL b, <op> => <localsOp> a b
+//   GET_LOCAL a, CONSTANT k, <op>  => <constantOp> a k
+//
+// The fused instruction reads its operands directly from the frame's slots
+// and the constant pool instead of pushing them onto the stack first.
+static bool fuseRegisterOp(Compiler* compiler, OpCode localsOp,
+                           OpCode constantOp) {
+  int right = recentOp(compiler, 0);
+  if (recentOp(compiler, 1) != OP_GET_LOCAL) return false;
+  if (right != OP_GET_LOCAL && right != OP_CONSTANT) return false;
+
+  uint8_t a = recentOperand(compiler, 1, 0);
+  uint8_t b = recentOperand(compiler, 0, 0);
+  discardOps(compiler, 2);
+  recordOp(compiler);
+  emitByte(compiler, right == OP_GET_LOCAL ? localsOp : constantOp);
+  emitByte(compiler, a);
+  emitByte(compiler, b);
+  return true;
+}
+
+// Attempts to fuse [code] with the most recently emitted instructions.
+// Returns true iff a superinstruction was emitted in place of [code].
+static bool fuseOp(Compiler* compiler, OpCode code) {
+  switch (code) {
+  case OP_POP:
+    // POP, POP => POPN 2.
+    if (recentOp(compiler, 0) == OP_POP) {
+      discardOps(compiler, 1);
+      recordOp(compiler);
+      emitByte(compiler, OP_POPN);
+      emitByte(compiler, 2);
+      return true;
+    }
+    // POPN n, POP => POPN n+1.
+    if (recentOp(compiler, 0) == OP_POPN &&
+        recentOperand(compiler, 0, 0) < UINT8_MAX) {
+      compiler->function->chunk.code[compiler->recentOps[0] + 1]++;
+      return true;
+    }
+    // SET_LOCAL a, POP => STORE_LOCAL a.
+    if (recentOp(compiler, 0) == OP_SET_LOCAL) {
+      uint8_t slot = recentOperand(compiler, 0, 0);
+      discardOps(compiler, 1);
+      recordOp(compiler);
+      emitByte(compiler, OP_STORE_LOCAL);
+      emitByte(compiler, slot);
+      return true;
+    }
+    return false;
+
+  case OP_ADD:
+    return fuseRegisterOp(compiler, OP_ADD_LOCALS, OP_ADD_LOCAL_CONSTANT);
+  case OP_MINUS:
+    return fuseRegisterOp(compiler, OP_MINUS_LOCALS, OP_MINUS_LOCAL_CONSTANT);
+  case OP_MULTIPLY:
+    return fuseRegisterOp(compiler, OP_MULTIPLY_LOCALS,
+                          OP_MULTIPLY_LOCAL_CONSTANT);
+  case OP_DIVIDE:
+    return fuseRegisterOp(compiler, OP_DIVIDE_LOCALS,
+                          OP_DIVIDE_LOCAL_CONSTANT);
+  case OP_MODULO:
+    return fuseRegisterOp(compiler, OP_MODULO_LOCALS,
+                          OP_MODULO_LOCAL_CONSTANT);
+
+  default:
+    return false;
+  }
+}
+
 static void emitOp(Compiler* compiler, OpCode code) {
+  // Superinstructions have the same stack effect as the instructions they
+  // replace, so count the effect of [code] whether or not it is fused.
+  adjustSlots(compiler, stackEffects[code]);
+  if (fuseOp(compiler, code)) return;
+  recordOp(compiler);
   emitByte(compiler, code);
 }
 
+// Emits OP_RETURN. Calls whose result would be returned by this instruction are
+// turned into tail calls, which reuse the caller's frame.
+static void emitReturn(Compiler* compiler) {
+  Chunk* chunk = &compiler->function->chunk;
+  if (recentOp(compiler, 0) == OP_CALL) {
+    chunk->code[compiler->recentOps[0]] = OP_TAIL_CALL;
+  }
+  if (compiler->matchEnd == chunk->count) {
+    for (int i = 0; i < compiler->armCallCount; i++) {
+      chunk->code[compiler->armCalls[i]] = OP_TAIL_CALL;
+    }
+  }
+  emitOp(compiler, OP_RETURN);
+}
+
 // Adds [value] the the Vm's constant pool.
 // Returns the address of the new constant within the pool.
 static int addConstant(Compiler* compiler, Value value) {
   if (IS_OBJ(value)) obaPushRoot(compiler->vm, AS_OBJ(value));
   writeValueBuffer(compiler->vm, &compiler->function->chunk.constants, value);
+  WRITE_BARRIER(compiler->vm, compiler->function);
   if (IS_OBJ(value)) obaPopRoot(compiler->vm);
   return compiler->function->chunk.constants.count - 1;
 }
@@ -196,6 +397,7 @@ static void emitError(Compiler* compiler, const char* format, ...) {
 
 static void patchJump(Compiler* compiler, int offset) {
   Chunk* chunk = &compiler->function->chunk;
+  markJumpTarget(compiler);
 
   // -2 to account for the placeholder bytes.
   int jump = chunk->count - offset - 2;
@@ -208,8 +410,43 @@ static void patchJump(Compiler* compiler, int offset) {
   chunk->code[offset + 1] = jump & 0xff;
 }
 
+static bool isComparison(int code) {
+  switch (code) {
+  case OP_GT:
+  case OP_LT:
+  case OP_GTE:
+  case OP_LTE:
+  case OP_EQ:
+  case OP_NEQ:
+    return true;
+  default:
+    return false;
+  }
+}
+
 static int emitJump(Compiler* compiler, OpCode op) {
-  emitOp(compiler, op);
+  // GET_LOCAL a, CONSTANT k, <cmp>, JUMP_IF_FALSE =>
+  //   JUMP_IF_LOCAL_CMP_FALSE a k <cmp>.
+  // GET_LOCAL a, GET_LOCAL b, <cmp>, JUMP_IF_FALSE =>
+  //   JUMP_IF_LOCALS_CMP_FALSE a b <cmp>.
+  int right = recentOp(compiler, 1);
+  if (op == OP_JUMP_IF_FALSE && recentOp(compiler, 2) == OP_GET_LOCAL &&
+      (right == OP_CONSTANT || right == OP_GET_LOCAL) &&
+      isComparison(recentOp(compiler, 0))) {
+    uint8_t a = recentOperand(compiler, 2, 0);
+    uint8_t b = recentOperand(compiler, 1, 0);
+    uint8_t comparison = recentOp(compiler, 0);
+    adjustSlots(compiler, stackEffects[op]);
+    discardOps(compiler, 3);
+    recordOp(compiler);
+    emitByte(compiler, right == OP_CONSTANT ? OP_JUMP_IF_LOCAL_CMP_FALSE
+                                            : OP_JUMP_IF_LOCALS_CMP_FALSE);
+    emitByte(compiler, a);
+    emitByte(compiler, b);
+    emitByte(compiler, comparison);
+  } else {
+    emitOp(compiler, op);
+  }
   emitByte(compiler, 0xff);
   emitByte(compiler, 0xff);
   return compiler->function->chunk.count - 2;
@@ -229,8 +466,17 @@ static void emitLoop(Compiler* compiler, int start) {
   emitByte(compiler, start & 0xff);
 }
 
-static int declareGlobal(Compiler* compiler, Value name) {
-  return addConstant(compiler, name);
+// Returns the module variable slot of the global [name], declaring it if
+// necessary.
+static int declareGlobal(Compiler* compiler, Token name) {
+  ObjString* string = copyString(compiler->vm, name.start, name.length);
+  int slot = declareModuleVariable(compiler->vm, compiler->parser->module,
+                                   string);
+  if (slot >= MAX_MODULE_VARIABLES) {
+    error(compiler, "Too many variables in module");
+    return 0;
+  }
+  return slot;
 }
 
 static void defineGlobal(Compiler* compiler, int global) {
@@ -244,6 +490,7 @@ static int addLocal(Compiler* compiler, Token name) {
   Local* local = &compiler->locals[compiler->localCount++];
   local->token = name;
   local->depth = -1;
+  local->slot = -1;
   local->isCaptured = false;
   return compiler->localCount;
 }
@@ -261,6 +508,12 @@ static void markInitialized(Compiler* compiler) {
   // the most recent one.
   Local* local = &compiler->locals[compiler->localCount - 1];
   local->depth = compiler->currentDepth;
+
+  // The local's value is the one on top of the stack.
+  local->slot = compiler->slotCount - 1;
+  if (local->slot > UINT8_MAX) {
+    error(compiler, "Too many values on the stack to define a variable");
+  }
 }
 
 static bool identifiersMatch(Token a, Token b) {
@@ -269,8 +522,7 @@ static bool identifiersMatch(Token a, Token b) {
 
 static int declareVariable(Compiler* compiler, Token name) {
   if (compiler->currentDepth == 0) {
-    return declareGlobal(
-        compiler, OBJ_VAL(copyString(compiler->vm, name.start, name.length)));
+    return declareGlobal(compiler, name);
   }
 
   int slot = compiler->localCount;
@@ -320,6 +572,34 @@ static int resolveLocal(Compiler* compiler, Token name) {
   return -1;
 }
 
+// Resolves the global [name] to a slot in the current module.
+//
+// Builtins are linked into the module the first time they are referenced, so
+// that the VM never has to search for them at runtime. Any other name is
+// declared as a variable that is expected to be defined later in the module;
+// reading it before then is a runtime error.
+static int resolveGlobal(Compiler* compiler, Token name) {
+  ObaVM* vm = compiler->vm;
+  ObjModule* module = compiler->parser->module;
+
+  ObjString* string = copyString(vm, name.start, name.length);
+  int slot = findModuleVariable(module, string);
+  if (slot >= 0) return slot;
+
+  Value builtin;
+  if (tableGet(vm->globals, string, &builtin)) {
+    slot = defineModuleVariable(vm, module, string, builtin);
+  } else {
+    slot = declareModuleVariable(vm, module, string);
+  }
+
+  if (slot >= MAX_MODULE_VARIABLES) {
+    error(compiler, "Too many variables in module");
+    return 0;
+  }
+  return slot;
+}
+
 // Resolves an upvalue from the enclosing function scope.
 //
 // If this is the first time the upvalue is being resolved, and it is found in
@@ -332,7 +612,7 @@ static int resolveUpvalue(Compiler* compiler, Token name) {
   int local = resolveLocal(compiler->parent, name);
   if (local >= 0) {
     compiler->parent->locals[local].isCaptured = true;
-    return addUpvalue(compiler, local, true);
+    return addUpvalue(compiler, compiler->parent->locals[local].slot, true);
   }
 
   int upvalue = resolveUpvalue(compiler->parent, name);
@@ -768,7 +1048,7 @@ static void parse(Compiler* compiler, int precedence) {
 
 static void expression(Compiler* compiler) { parse(compiler, PREC_LOWEST); }
 
-static void constructor(Compiler* compiler, ObjString* family) {
+static void constructor(Compiler* compiler, ObjString* family, int tag) {
   consume(compiler, TOK_IDENT, "Expected an identifier");
 
   Token nameToken = compiler->parser->previous;
@@ -783,7 +1063,7 @@ static void constructor(Compiler* compiler, ObjString* family) {
   int arity = 0;
   while (match(compiler, TOK_IDENT)) arity++;
 
-  ObjCtor* ctor = newCtor(compiler->vm, family, name, arity);
+  ObjCtor* ctor = newCtor(compiler->vm, family, name, arity, tag);
   obaPushRoot(compiler->vm, (Obj*)ctor);
 
   // This always creates a global because data types can only be declared at
@@ -802,9 +1082,10 @@ static void data(Compiler* compiler) {
   obaPushRoot(compiler->vm, (Obj*)family);
   consume(compiler, TOK_ASSIGN, "Expected '='");
 
+  int tag = 0;
   do {
     ignoreNewlines(compiler);
-    constructor(compiler, family);
+    constructor(compiler, family, tag++);
   } while (match(compiler, TOK_GUARD));
 
   obaPopRoot(compiler->vm);
@@ -881,6 +1162,7 @@ static void ifStmt(Compiler* compiler) {
 
 static void whileStmt(Compiler* compiler) {
   int loopStart = compiler->function->chunk.count;
+  markJumpTarget(compiler);
 
   // Compile the conditional.
   expression(compiler);
@@ -904,7 +1186,7 @@ static void functionBlockBody(Compiler* compiler) {
 static void functionExpressionBody(Compiler* compiler) {
   expression(compiler);
   // Insert implicit return so the user doesn't have to.
-  emitOp(compiler, OP_RETURN);
+  emitReturn(compiler);
 }
 
 static void functionBody(Compiler* compiler) {
@@ -924,39 +1206,12 @@ static void functionBody(Compiler* compiler) {
 static void parameterList(Compiler* compiler) {
   while (match(compiler, TOK_IDENT)) {
     int local = declareVariable(compiler, compiler->parser->previous);
+    adjustSlots(compiler, 1);
     defineVariable(compiler, local);
     compiler->function->arity++;
   }
 }
 
-// TODO(kendal): Dedup this with function definition.
-static int lambda(Compiler* compiler) {
-  Compiler fnCompiler;
-  initCompiler(compiler->vm, &fnCompiler, compiler->parser, compiler);
-
-  enterScope(&fnCompiler);
-  parameterList(&fnCompiler);
-  ignoreNewlines(&fnCompiler);
-  consume(&fnCompiler, TOK_ASSIGN, "Missing lambda expression");
-  functionExpressionBody(&fnCompiler);
-
-  ObjFunction* fn = endCompiler(&fnCompiler, "", 0);
-  if (fn == NULL) return -1;
-  obaPushRoot(compiler->vm, (Obj*)fn);
-
-  emitOp(compiler, OP_CLOSURE);
-  emitByte(compiler, addConstant(compiler, OBJ_VAL(fn)));
-
-  for (int i = 0; i < fn->upvalueCount; i++) {
-    emitByte(compiler, fnCompiler.upvalues[i].isLocal ? 1 : 0);
-    emitByte(compiler, fnCompiler.upvalues[i].index);
-  }
-
-  obaPopRoot(compiler->vm);
-
-  return fn->arity;
-}
-
 static void functionDefinition(Compiler* compiler) {
   if (!match(compiler, TOK_IDENT)) {
     error(compiler, "Expected an identifier");
@@ -1003,7 +1258,7 @@ static void returnStmt(Compiler* compiler) {
     expression(compiler);
   }
 
-  emitOp(compiler, OP_RETURN);
+  emitReturn(compiler);
   ignoreNewlines(compiler);
 }
 
@@ -1059,8 +1314,17 @@ static void grouping(Compiler* compiler, bool canAssign) {
   consume(compiler, TOK_RPAREN, "Expected ')' after expression.");
 }
 
+// Joins the top [partCount] values on the stack into a single string.
+static void emitBuildString(Compiler* compiler, int partCount) {
+  emitOp(compiler, OP_BUILD_STRING);
+  emitByte(compiler, partCount);
+  adjustSlots(compiler, -partCount);
+}
+
 static void interpolation(Compiler* compiler, bool canAssign) {
-  bool first = true;
+  // Every piece of the string is left on the stack and joined at the end, so
+  // no intermediate strings are created.
+  int partCount = 0;
   do {
     // The opening string.
     literal(compiler, false);
@@ -1069,24 +1333,20 @@ static void interpolation(Compiler* compiler, bool canAssign) {
     // The interpolated expression.
     expression(compiler);
     ignoreNewlines(compiler);
+    partCount += 2;
 
-    // Convert the expression result to a string and add it to the previous
-    // string literal.
-    emitOp(compiler, OP_STRING);
-    emitOp(compiler, OP_ADD);
-
-    // If this is not the first set of TOK_INTERPOLATION + TOK_EXPRESSION then
-    // add it to the previous one.
-    if (!first) {
-      emitOp(compiler, OP_ADD);
+    // Join the pieces so far if the instruction's operand would overflow.
+    // The result is the first piece of the rest of the string.
+    if (partCount > UINT8_MAX - 2) {
+      emitBuildString(compiler, partCount);
+      partCount = 1;
     }
-    first = false;
   } while (match(compiler, TOK_INTERPOLATION));
 
   // The trailing string.
   consume(compiler, TOK_STRING, "Expect end of string interpolation.");
   literal(compiler, false);
-  emitOp(compiler, OP_ADD);
+  emitBuildString(compiler, partCount + 1);
 }
 
 static void variable(Compiler* compiler, bool canAssign, bool imported) {
@@ -1096,8 +1356,28 @@ static void variable(Compiler* compiler, bool canAssign, bool imported) {
   Token name = compiler->parser->previous;
   bool set = canAssign && match(compiler, TOK_ASSIGN);
 
+  if (imported) {
+    // The variable is resolved at runtime, from the module on the stack.
+    if (set) {
+      error(compiler, "Cannot reassign global variable");
+      expression(compiler);
+    }
+    Value value = OBJ_VAL(copyString(compiler->vm, name.start, name.length));
+    int constant = addConstant(compiler, value);
+    int cache = addImportCache(compiler->vm, &compiler->function->chunk);
+    if (cache > UINT16_MAX) {
+      error(compiler, "Too many imported variables in function");
+    }
+    emitOp(compiler, OP_GET_IMPORTED_VARIABLE);
+    emitByte(compiler, constant);
+    emitByte(compiler, (cache >> 8) & 0xff);
+    emitByte(compiler, cache & 0xff);
+    return;
+  }
+
   int arg = resolveLocal(compiler, name);
   if (arg >= 0) {
+    arg = compiler->locals[arg].slot;
     getOp = OP_GET_LOCAL;
     setOp = OP_SET_LOCAL;
   } else if ((arg = resolveUpvalue(compiler, name)) >= 0) {
@@ -1107,17 +1387,15 @@ static void variable(Compiler* compiler, bool canAssign, bool imported) {
     if (set) {
       error(compiler, "Cannot reassign global variable");
     }
-    Value value = OBJ_VAL(copyString(compiler->vm, name.start, name.length));
-    arg = addConstant(compiler, value);
+    arg = resolveGlobal(compiler, name);
     getOp = OP_GET_GLOBAL;
+    // Reassigning a global is an error reported above.
+    setOp = OP_GET_GLOBAL;
   }
 
   if (set) {
     expression(compiler);
   }
-  if (imported) {
-    getOp = OP_GET_IMPORTED_VARIABLE;
-  }
 
   emitOp(compiler, set ? setOp : getOp);
   emitByte(compiler, (uint8_t)arg);
@@ -1143,6 +1421,7 @@ static void functionCall(Compiler* compiler, bool canAssign) {
   consume(compiler, TOK_RPAREN, "Expected ')' after parameter list");
   emitOp(compiler, OP_CALL);
   emitByte(compiler, argCount);
+  adjustSlots(compiler, -argCount);
 }
 
 static void identifier(Compiler* compiler, bool canAssign) {
@@ -1183,19 +1462,117 @@ static void pattern(Compiler* compiler) {
   }
 }
 
+// Records that the value of the arm body just compiled is the value of the
+// match expression, given that [callCount] calls were recorded before the body.
+static void endArmBody(Compiler* compiler, int callCount) {
+  Chunk* chunk = &compiler->function->chunk;
+  if (recentOp(compiler, 0) == OP_CALL) {
+    // The body's value is the result of this call.
+    compiler->armCallCount = callCount;
+    if (compiler->armCallCount < MAX_TAIL_ARMS) {
+      compiler->armCalls[compiler->armCallCount++] = compiler->recentOps[0];
+    }
+  } else if (compiler->matchEnd != chunk->count) {
+    // The body does not end with a match either, so none of the calls recorded
+    // while compiling it produce its value.
+    compiler->armCallCount = callCount;
+  }
+}
+
+// Describes the pattern emitted at [start] in [arm], if the pattern is a single
+// instruction that loads a constant or a module variable. Returns false if the
+// pattern's value is only known by running it.
+static bool describePattern(Compiler* compiler, int start, MatchArm* arm) {
+  Chunk* chunk = &compiler->function->chunk;
+  if (compiler->recentOps[0] != start) return false;
+
+  arm->isVariable = false;
+  switch (chunk->code[start]) {
+  case OP_CONSTANT:
+    arm->index = chunk->code[start + 1];
+    return true;
+  case OP_TRUE:
+  case OP_FALSE: {
+    int constant =
+        addConstant(compiler, OBA_BOOL(chunk->code[start] == OP_TRUE));
+    arm->index = (uint8_t)constant;
+    return constant <= UINT8_MAX;
+  }
+  case OP_GET_GLOBAL:
+    arm->isVariable = true;
+    arm->index = chunk->code[start + 1];
+    return true;
+  default:
+    return false;
+  }
+}
+
+// Adds [arm] to the table of the match being compiled. If [arm] is NULL, its
+// pattern can't be dispatched on and the match always tests its arms in order.
+static void addMatchArm(Compiler* compiler, MatchArm* arm) {
+  MatchTable* table =
+      &compiler->function->chunk.matchTables.values[compiler->matchTable];
+  if (arm == NULL) {
+    table->state = MATCH_SEQUENTIAL;
+  } else if (table->state != MATCH_SEQUENTIAL) {
+    writeMatchArmBuffer(compiler->vm, &table->arms, *arm);
+  }
+}
+
 static void equation(Compiler* compiler) {
+  Chunk* chunk = &compiler->function->chunk;
+  int patternStart = chunk->count;
   pattern(compiler);
 
-  // Compile the RHS lambda expression, which only gets evaluated if the pattern
-  // above matched.
-  int arity = lambda(compiler);
+  MatchArm arm;
+  bool isKnown = describePattern(compiler, patternStart, &arm);
 
-  int skipThisEquation = emitJump(compiler, OP_JUMP_IF_NOT_MATCH);
+  // If the pattern does not match, skip this equation with the value still on
+  // the stack. Otherwise the value's fields are pushed on top of it and bound
+  // to the arm's variables.
+  emitOp(compiler, OP_JUMP_IF_NOT_MATCH);
+  int fieldCountOffset = chunk->count;
+  emitByte(compiler, 0);
+  emitByte(compiler, 0xff);
+  emitByte(compiler, 0xff);
+  int skipThisEquation = chunk->count - 2;
 
-  // The lambda's arguments are already in the correct stack slots if the
-  // pattern matched; call the lambda immediately.
-  emitOp(compiler, OP_CALL);
-  emitByte(compiler, arity);
+  enterScope(compiler);
+  int fieldCount = 0;
+  while (match(compiler, TOK_IDENT)) {
+    int local = declareVariable(compiler, compiler->parser->previous);
+    adjustSlots(compiler, 1);
+    defineVariable(compiler, local);
+    fieldCount++;
+  }
+  chunk->code[fieldCountOffset] = fieldCount;
+
+  ignoreNewlines(compiler);
+  consume(compiler, TOK_ASSIGN, "Expected '=' after pattern");
+
+  // OP_MATCH may jump straight to the body.
+  markJumpTarget(compiler);
+  arm.bindingCount = fieldCount;
+  arm.body = chunk->count;
+  addMatchArm(compiler, isKnown ? &arm : NULL);
+
+  int callCount = compiler->armCallCount;
+  compiler->armDepth++;
+  expression(compiler);
+  compiler->armDepth--;
+  endArmBody(compiler, callCount);
+
+  // Leave the arm's scope, replacing the value and its fields with the arm's
+  // result.
+  compiler->currentDepth--;
+  while (compiler->localCount > 0 &&
+         compiler->locals[compiler->localCount - 1].depth >
+             compiler->currentDepth) {
+    compiler->localCount--;
+  }
+  emitOp(compiler, OP_POP_UNDER);
+  emitByte(compiler, fieldCount + 1);
+  adjustSlots(compiler, -(fieldCount + 1));
 
   int skipRemainingEquations = emitJump(compiler, OP_JUMP);
   patchJump(compiler, skipThisEquation);
@@ -1216,6 +1593,8 @@ static void equation(Compiler* compiler) {
 // TODO(kendal): Emit an error if there are constructor patterns in this match
 // expression, and some of the constructors in the family aren't handled.
 static void matchExpr(Compiler* compiler, bool canAssign) {
+  int callCount = compiler->armCallCount;
+
   // Compile the expression to push the value to match onto the stack.
   expression(compiler);
   ignoreNewlines(compiler);
@@ -1225,7 +1604,24 @@ static void matchExpr(Compiler* compiler, bool canAssign) {
     return;
   }
 
+  // Dispatch on the value to the arm whose pattern it matches, before falling
+  // back to testing the arms in order.
+  Chunk* chunk = &compiler->function->chunk;
+  int enclosingTable = compiler->matchTable;
+  compiler->matchTable = addMatchTable(compiler->vm, chunk);
+  if (compiler->matchTable > UINT16_MAX) {
+    error(compiler, "Too many match expressions in function");
+  }
+  emitOp(compiler, OP_MATCH);
+  emitByte(compiler, (compiler->matchTable >> 8) & 0xff);
+  emitByte(compiler, compiler->matchTable & 0xff);
+
+  // Forget the calls in the value expression, and in any match before this one
+  // that is not itself the body of an arm.
+  compiler->armCallCount = compiler->armDepth == 0 ? 0 : callCount;
   equation(compiler);
+  compiler->matchTable = enclosingTable;
+  compiler->matchEnd = compiler->function->chunk.count;
   consume(compiler, TOK_SEMICOLON, "Expected ';'");
 }
 
@@ -1325,6 +1721,7 @@ ObjFunction* endCompiler(Compiler* compiler, const char* debugName,
 
   compiler->function->name =
       copyString(compiler->vm, debugName, debugNameLength);
+  WRITE_BARRIER(compiler->vm, compiler->function);
 
   if (compiler->parent == NULL) {
     emitOp(compiler, OP_END_MODULE);
@@ -1334,6 +1731,7 @@ ObjFunction* endCompiler(Compiler* compiler, const char* debugName,
   // It is only reached when the module we just compiled is not the "main"
   // module.
   emitOp(compiler, OP_EXIT);
+  compiler->function->maxSlots = compiler->maxSlots;
 
   compiler->vm->compiler = compiler->parent;
   return compiler->function;
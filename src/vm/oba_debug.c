@@ -5,6 +5,12 @@
 #include "oba_value.h"
 #include "oba_vm.h"
 
+static const char* opNames[] = {
+#define OPCODE(name, _) "OP_" #name,
+#include "oba_opcodes.h"
+#undef OPCODE
+};
+
 static int constantInstruction(const char* name, Chunk* chunk, int offset) {
   uint8_t constant = chunk->code[offset + 1];
   printf("%-16s %4d '", name, constant);
@@ -24,6 +30,82 @@ static int byteInstruction(const char* name, Chunk* chunk, int offset) {
   return offset + 2;
 }
 
+static int twoByteInstruction(const char* name, Chunk* chunk, int offset) {
+  uint8_t a = chunk->code[offset + 1];
+  uint8_t b = chunk->code[offset + 2];
+  printf("%-16s %4d %4d\n", name, a, b);
+  return offset + 3;
+}
+
+static int localConstantInstruction(const char* name, Chunk* chunk,
+                                    int offset) {
+  uint8_t slot = chunk->code[offset + 1];
+  uint8_t constant = chunk->code[offset + 2];
+  printf("%-16s %4d '", name, slot);
+  printValue(chunk->constants.values[constant]);
+  printf("'\n");
+  return offset + 3;
+}
+
+static int compareJumpInstruction(const char* name, Chunk* chunk,
+                                  int offset) {
+  uint8_t slot = chunk->code[offset + 1];
+  uint8_t constant = chunk->code[offset + 2];
+  uint8_t comparison = chunk->code[offset + 3];
+  uint16_t jump = (uint16_t)(chunk->code[offset + 4] << 8);
+  jump |= chunk->code[offset + 5];
+  printf("%-16s %4d %s '", name, slot, opNames[comparison]);
+  printValue(chunk->constants.values[constant]);
+  printf("' %4d -> %d\n", offset, offset + 6 + jump);
+  return offset + 6;
+}
+
+static int localsCompareJumpInstruction(const char* name, Chunk* chunk,
+                                        int offset) {
+  uint8_t a = chunk->code[offset + 1];
+  uint8_t b = chunk->code[offset + 2];
+  uint8_t comparison = chunk->code[offset + 3];
+  uint16_t jump = (uint16_t)(chunk->code[offset + 4] << 8);
+  jump |= chunk->code[offset + 5];
+  printf("%-16s %4d %s %4d %4d -> %d\n", name, a, opNames[comparison], b,
+         offset, offset + 6 + jump);
+  return offset + 6;
+}
+
+static int matchInstruction(const char* name, Chunk* chunk, int offset) {
+  uint16_t index = (uint16_t)(chunk->code[offset + 1] << 8);
+  index |= chunk->code[offset + 2];
+  MatchTable* table = &chunk->matchTables.values[index];
+  printf("%-16s %4d", name, index);
+  if (table->state == MATCH_SEQUENTIAL) {
+    printf(" sequential\n");
+    return offset + 3;
+  }
+  for (int i = 0; i < table->arms.count; i++) {
+    printf(" -> %d", table->arms.values[i].body);
+  }
+  printf("\n");
+  return offset + 3;
+}
+
+static int matchJumpInstruction(const char* name, Chunk* chunk, int offset) {
+  uint8_t fieldCount = chunk->code[offset + 1];
+  uint16_t jump = (uint16_t)(chunk->code[offset + 2] << 8);
+  jump |= chunk->code[offset + 3];
+  printf("%-16s %4d %4d -> %d\n", name, fieldCount, offset, offset + 4 + jump);
+  return offset + 4;
+}
+
+static int importInstruction(const char* name, Chunk* chunk, int offset) {
+  uint8_t constant = chunk->code[offset + 1];
+  uint16_t cache = (uint16_t)(chunk->code[offset + 2] << 8);
+  cache |= chunk->code[offset + 3];
+  printf("%-16s %4d '", name, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("' cache %d\n", cache);
+  return offset + 4;
+}
+
 static int jumpInstruction(const char* name, int sign, Chunk* chunk,
                            int offset) {
   uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
@@ -50,14 +132,39 @@ int disassembleInstruction(Chunk* chunk, int offset) {
     return constantInstruction("OP_ERROR", chunk, offset);
   case OP_ADD:
     return simpleInstruction("OP_ADD", chunk, offset);
+  case OP_ADD_NUM:
+    return simpleInstruction("OP_ADD_NUM", chunk, offset);
+  case OP_ADD_STR:
+    return simpleInstruction("OP_ADD_STR", chunk, offset);
+  case OP_ADD_LOCALS:
+    return twoByteInstruction("OP_ADD_LOCALS", chunk, offset);
+  case OP_ADD_LOCAL_CONSTANT:
+    return localConstantInstruction("OP_ADD_LOCAL_CONSTANT", chunk, offset);
   case OP_MINUS:
     return simpleInstruction("OP_MINUS", chunk, offset);
+  case OP_MINUS_LOCALS:
+    return twoByteInstruction("OP_MINUS_LOCALS", chunk, offset);
+  case OP_MINUS_LOCAL_CONSTANT:
+    return localConstantInstruction("OP_MINUS_LOCAL_CONSTANT", chunk, offset);
   case OP_MULTIPLY:
     return simpleInstruction("OP_MULTIPLY", chunk, offset);
+  case OP_MULTIPLY_LOCALS:
+    return twoByteInstruction("OP_MULTIPLY_LOCALS", chunk, offset);
+  case OP_MULTIPLY_LOCAL_CONSTANT:
+    return localConstantInstruction("OP_MULTIPLY_LOCAL_CONSTANT", chunk,
+                                    offset);
   case OP_DIVIDE:
     return simpleInstruction("OP_DIVIDE", chunk, offset);
+  case OP_DIVIDE_LOCALS:
+    return twoByteInstruction("OP_DIVIDE_LOCALS", chunk, offset);
+  case OP_DIVIDE_LOCAL_CONSTANT:
+    return localConstantInstruction("OP_DIVIDE_LOCAL_CONSTANT", chunk, offset);
   case OP_MODULO:
     return simpleInstruction("OP_MODULO", chunk, offset);
+  case OP_MODULO_LOCALS:
+    return twoByteInstruction("OP_MODULO_LOCALS", chunk, offset);
+  case OP_MODULO_LOCAL_CONSTANT:
+    return localConstantInstruction("OP_MODULO_LOCAL_CONSTANT", chunk, offset);
   case OP_TRUE:
     return simpleInstruction("OP_TRUE", chunk, offset);
   case OP_FALSE:
@@ -74,16 +181,22 @@ int disassembleInstruction(Chunk* chunk, int offset) {
     return simpleInstruction("OP_LTE", chunk, offset);
   case OP_EQ:
     return simpleInstruction("OP_EQ", chunk, offset);
+  case OP_EQ_NUM:
+    return simpleInstruction("OP_EQ_NUM", chunk, offset);
   case OP_NEQ:
     return simpleInstruction("OP_NEQ", chunk, offset);
-  case OP_STRING:
-    return simpleInstruction("OP_STRING", chunk, offset);
+  case OP_NEQ_NUM:
+    return simpleInstruction("OP_NEQ_NUM", chunk, offset);
+  case OP_BUILD_STRING:
+    return byteInstruction("OP_BUILD_STRING", chunk, offset);
   case OP_DEFINE_GLOBAL:
-    return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+    return byteInstruction("OP_DEFINE_GLOBAL", chunk, offset);
   case OP_GET_GLOBAL:
-    return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+    return byteInstruction("OP_GET_GLOBAL", chunk, offset);
   case OP_SET_LOCAL:
     return byteInstruction("OP_SET_LOCAL", chunk, offset);
+  case OP_STORE_LOCAL:
+    return byteInstruction("OP_STORE_LOCAL", chunk, offset);
   case OP_GET_LOCAL:
     return byteInstruction("OP_GET_LOCAL", chunk, offset);
   case OP_SET_UPVALUE:
@@ -93,21 +206,34 @@ int disassembleInstruction(Chunk* chunk, int offset) {
   case OP_CLOSE_UPVALUE:
     return simpleInstruction("OP_CLOSE_UPVALUE", chunk, offset);
   case OP_GET_IMPORTED_VARIABLE:
-    return constantInstruction("OP_GET_IMPORTED_VARIABLE", chunk, offset);
+    return importInstruction("OP_GET_IMPORTED_VARIABLE", chunk, offset);
   case OP_POP:
     return simpleInstruction("OP_POP", chunk, offset);
+  case OP_POPN:
+    return byteInstruction("OP_POPN", chunk, offset);
+  case OP_POP_UNDER:
+    return byteInstruction("OP_POP_UNDER", chunk, offset);
   case OP_JUMP:
     return jumpInstruction("OP_JUMP", 1, chunk, offset);
   case OP_JUMP_IF_FALSE:
     return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
   case OP_JUMP_IF_TRUE:
     return jumpInstruction("OP_JUMP_IF_TRUE", 1, chunk, offset);
+  case OP_JUMP_IF_LOCAL_CMP_FALSE:
+    return compareJumpInstruction("OP_JUMP_IF_LOCAL_CMP_FALSE", chunk, offset);
+  case OP_JUMP_IF_LOCALS_CMP_FALSE:
+    return localsCompareJumpInstruction("OP_JUMP_IF_LOCALS_CMP_FALSE", chunk,
+                                        offset);
+  case OP_MATCH:
+    return matchInstruction("OP_MATCH", chunk, offset);
   case OP_JUMP_IF_NOT_MATCH:
-    return jumpInstruction("OP_JUMP_IF_NOT_MATCH", 1, chunk, offset);
+    return matchJumpInstruction("OP_JUMP_IF_NOT_MATCH", chunk, offset);
   case OP_LOOP:
     return jumpInstruction("OP_LOOP", -1, chunk, offset);
   case OP_CALL:
     return byteInstruction("OP_CALL", chunk, offset);
+  case OP_TAIL_CALL:
+    return byteInstruction("OP_TAIL_CALL", chunk, offset);
   case OP_CLOSURE: {
     offset++;
     uint8_t constant = chunk->code[offset++];
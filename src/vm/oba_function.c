@@ -11,6 +11,9 @@ ObjFunction* newFunction(ObaVM* vm, ObjModule* module) {
   initChunk(&function->chunk);
   function->arity = 0;
   function->upvalueCount = 0;
+  function->maxSlots = 0;
+  function->hotness = 0;
+  function->jit = NULL;
 
   obaPopRoot(vm);
   return function;
@@ -40,8 +40,19 @@ typedef struct {
   // The number of upvalues this function closes over.
   int upvalueCount;
 
+  // The most values this function has on the stack at once, including its
+  // arguments.
+  int maxSlots;
+
   // The module where this function is defined.
   ObjModule* module;
+
+  // The number of times this function has been called or looped, counted
+  // until the function is compiled by the JIT.
+  int hotness;
+
+  // The machine code compiled from [chunk] by the JIT, or NULL.
+  struct JitCode* jit;
 } ObjFunction;
 
 // An instance of ObjFunction which captures the values in the function's
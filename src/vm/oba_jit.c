@@ -0,0 +1,920 @@
+#include "oba_jit.h"
+
+#ifdef OBA_JIT
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "oba_common.h"
+#include "oba_value.h"
+#include "oba_vm.h"
+
+// A baseline JIT that translates each bytecode instruction into a fixed
+// template of x86-64 instructions.
+//
+// The generated code keeps the interpreter's view of the world intact: values
+// live on the VM's stack and in the frame's slots exactly as they would if the
+// bytecode were interpreted. This means control can pass back to the
+// interpreter before any instruction. The JIT only translates instructions
+// whose common case can be done without calling back into the VM (arithmetic
+// and comparisons on numbers, locals, globals and jumps). Everything else,
+// including calls and returns, exits to the interpreter, which re-enters the
+// machine code after the next call, return or loop.
+//
+// While machine code runs, these registers hold the interpreter's state:
+//
+//   rbx: vm->stackTop
+//   r12: the current frame's slots
+//   r13: the vm
+//
+// The stack always has room for every value the function pushes, since the
+// interpreter reserves it when the function is called.
+
+typedef enum {
+  RAX = 0,
+  RCX = 1,
+  RDX = 2,
+  RBX = 3,
+  RSP = 4,
+  RBP = 5,
+  RSI = 6,
+  RDI = 7,
+  R12 = 12,
+  R13 = 13,
+} Register;
+
+// Condition codes for conditional jumps and setcc.
+typedef enum {
+  CC_B = 0x2,
+  CC_AE = 0x3,
+  CC_E = 0x4,
+  CC_NE = 0x5,
+  CC_A = 0x7,
+  CC_P = 0xa,
+  CC_NP = 0xb,
+} Condition;
+
+// Opcodes of the two-register ALU instructions used by the JIT.
+#define ALU_ADD 0x01
+#define ALU_SUB 0x29
+#define ALU_AND 0x21
+#define ALU_CMP 0x39
+#define ALU_MOV 0x89
+
+#define VALUE_SIZE ((int)sizeof(Value))
+
+// A rel32 operand that must be patched once all instructions are emitted.
+typedef struct {
+  // The offset of the operand in the generated code.
+  int at;
+
+  // The bytecode offset of the instruction the operand refers to.
+  int offset;
+} Fixup;
+
+DECLARE_BUFFER(Fixup, Fixup);
+DEFINE_BUFFER(Fixup, Fixup);
+
+typedef struct {
+  ObaVM* vm;
+  ObjFunction* function;
+  ByteBuffer code;
+
+  // The offset in [code] of each bytecode instruction.
+  int* entries;
+
+  // The offset in [code] of the routine that returns to the interpreter.
+  int epilogue;
+
+  // Jumps to other instructions in the same function.
+  FixupBuffer jumps;
+
+  // Jumps taken when an instruction's operands fail a type check. These are
+  // bound to stubs that hand the instruction back to the interpreter.
+  FixupBuffer exits;
+} Assembler;
+
+// The signature of the generated code's entry point. It begins executing at
+// [target] and returns the bytecode offset where the interpreter must resume.
+typedef int (*JitFn)(ObaVM* vm, Value* slots, uint8_t* target);
+
+// Encoding ------------------------------------------------------------------
+
+static void emit(Assembler* as, uint8_t byte) {
+  writeByteBuffer(as->vm, &as->code, byte);
+}
+
+static void emit32(Assembler* as, uint32_t value) {
+  for (int i = 0; i < 4; i++) emit(as, (value >> (8 * i)) & 0xff);
+}
+
+static void emit64(Assembler* as, uint64_t value) {
+  for (int i = 0; i < 8; i++) emit(as, (value >> (8 * i)) & 0xff);
+}
+
+static int here(Assembler* as) { return as->code.count; }
+
+static void patch32(Assembler* as, int at, int32_t value) {
+  for (int i = 0; i < 4; i++) {
+    as->code.values[at + i] = ((uint32_t)value >> (8 * i)) & 0xff;
+  }
+}
+
+// Emits a REX prefix, if one is needed, for an instruction whose ModRM reg
+// field is [reg] and whose r/m field is [rm].
+static void emitRex(Assembler* as, bool wide, int reg, int rm) {
+  uint8_t rex = 0x40 | (wide ? 8 : 0) | (reg & 8) >> 1 | (rm & 8) >> 3;
+  if (rex != 0x40) emit(as, rex);
+}
+
+// Emits the ModRM byte addressing [base + disp], with [reg] in the reg field.
+static void emitMem(Assembler* as, int reg, int base, int32_t disp) {
+  emit(as, 0x80 | (reg & 7) << 3 | (base & 7));
+  if ((base & 7) == RSP) emit(as, 0x24); // SIB: no index.
+  emit32(as, disp);
+}
+
+// op dst, src.
+static void aluReg(Assembler* as, uint8_t op, int dst, int src) {
+  emitRex(as, true, src, dst);
+  emit(as, op);
+  emit(as, 0xc0 | (src & 7) << 3 | (dst & 7));
+}
+
+// add/sub reg, imm32.
+static void addImm(Assembler* as, int reg, int32_t value) {
+  emitRex(as, true, 0, reg);
+  emit(as, 0x81);
+  emit(as, 0xc0 | (value < 0 ? 5 : 0) << 3 | (reg & 7));
+  emit32(as, value < 0 ? -value : value);
+}
+
+// mov dst, [base + disp].
+static void load(Assembler* as, int dst, int base, int32_t disp) {
+  emitRex(as, true, dst, base);
+  emit(as, 0x8b);
+  emitMem(as, dst, base, disp);
+}
+
+// mov [base + disp], src.
+static void store(Assembler* as, int base, int32_t disp, int src) {
+  emitRex(as, true, src, base);
+  emit(as, 0x89);
+  emitMem(as, src, base, disp);
+}
+
+// mov dst, imm64.
+static void loadImm(Assembler* as, int dst, uint64_t value) {
+  emitRex(as, true, 0, dst);
+  emit(as, 0xb8 | (dst & 7));
+  emit64(as, value);
+}
+
+// An SSE instruction operating on xmm[reg] and [base + disp].
+static void sseMem(Assembler* as, uint8_t prefix, uint8_t op, int reg,
+                   int base, int32_t disp) {
+  if (prefix != 0) emit(as, prefix);
+  emitRex(as, false, reg, base);
+  emit(as, 0x0f);
+  emit(as, op);
+  emitMem(as, reg, base, disp);
+}
+
+// An SSE instruction operating on two registers.
+static void sseReg(Assembler* as, uint8_t prefix, uint8_t op, int dst,
+                   int src) {
+  if (prefix != 0) emit(as, prefix);
+  emit(as, 0x0f);
+  emit(as, op);
+  emit(as, 0xc0 | (dst & 7) << 3 | (src & 7));
+}
+
+// setcc reg8.
+static void setcc(Assembler* as, Condition cc, int reg) {
+  emit(as, 0x0f);
+  emit(as, 0x90 | cc);
+  emit(as, 0xc0 | reg);
+}
+
+// Emits a jcc with an unbound target, and returns the offset of its operand.
+static int jcc(Assembler* as, Condition cc) {
+  emit(as, 0x0f);
+  emit(as, 0x80 | cc);
+  emit32(as, 0);
+  return here(as) - 4;
+}
+
+// Emits a jmp with an unbound target, and returns the offset of its operand.
+static int jmp(Assembler* as) {
+  emit(as, 0xe9);
+  emit32(as, 0);
+  return here(as) - 4;
+}
+
+// Binds the rel32 operand at [at] to [target].
+static void bind(Assembler* as, int at, int target) {
+  patch32(as, at, target - (at + 4));
+}
+
+// Jumps to the interpreter at [offset] if condition [cc] holds.
+static void guard(Assembler* as, Condition cc, int offset) {
+  writeFixupBuffer(as->vm, &as->exits, (Fixup){jcc(as, cc), offset});
+}
+
+// Jumps to the instruction at bytecode offset [offset].
+static void jumpTo(Assembler* as, int at, int offset) {
+  writeFixupBuffer(as->vm, &as->jumps, (Fixup){at, offset});
+}
+
+// Values --------------------------------------------------------------------
+//
+// These templates read and write Values in memory, and are the only part of
+// the JIT that depends on how Values are represented.
+
+#ifdef OBA_NAN_TAGGING
+
+static void guardNumber(Assembler* as, int base, int32_t disp, int offset) {
+  load(as, RAX, base, disp);
+  loadImm(as, RCX, QNAN);
+  aluReg(as, ALU_AND, RAX, RCX);
+  aluReg(as, ALU_CMP, RAX, RCX);
+  guard(as, CC_E, offset);
+}
+
+static void loadNumber(Assembler* as, int xmm, int base, int32_t disp) {
+  sseMem(as, 0xf2, 0x10, xmm, base, disp); // movsd
+}
+
+// Stores the number in xmm0.
+static void storeNumber(Assembler* as, int base, int32_t disp) {
+  sseMem(as, 0xf2, 0x11, 0, base, disp); // movsd
+}
+
+// Stores the boolean in al.
+static void storeBool(Assembler* as, int base, int32_t disp) {
+  sseReg(as, 0, 0xb6, RAX, RAX); // movzx eax, al
+  loadImm(as, RCX, FALSE_VAL);
+  aluReg(as, ALU_ADD, RAX, RCX);
+  store(as, base, disp, RAX);
+}
+
+// Leaves 1 in eax if the value is true and 0 if it is false.
+static void guardBool(Assembler* as, int base, int32_t disp, int offset) {
+  load(as, RAX, base, disp);
+  loadImm(as, RCX, FALSE_VAL);
+  aluReg(as, ALU_SUB, RAX, RCX);
+  emit(as, 0x48); // cmp rax, 1
+  emit(as, 0x83);
+  emit(as, 0xf8);
+  emit(as, 0x01);
+  guard(as, CC_A, offset);
+}
+
+static void guardDefined(Assembler* as, int base, int32_t disp, int offset) {
+  load(as, RAX, base, disp);
+  loadImm(as, RCX, UNDEFINED_VAL);
+  aluReg(as, ALU_CMP, RAX, RCX);
+  guard(as, CC_E, offset);
+}
+
+static void copyValue(Assembler* as, int dst, int32_t dstDisp, int src,
+                      int32_t srcDisp) {
+  load(as, RAX, src, srcDisp);
+  store(as, dst, dstDisp, RAX);
+}
+
+static void storeValue(Assembler* as, int base, int32_t disp, Value value) {
+  loadImm(as, RAX, value);
+  store(as, base, disp, RAX);
+}
+
+#else
+
+#define TYPE_OFFSET ((int)offsetof(Value, type))
+#define AS_OFFSET ((int)offsetof(Value, as))
+
+// cmp dword [base + disp], type.
+static void compareType(Assembler* as, int base, int32_t disp,
+                        ValueType type) {
+  emitRex(as, false, 0, base);
+  emit(as, 0x81);
+  emitMem(as, 7, base, disp + TYPE_OFFSET);
+  emit32(as, type);
+}
+
+// mov dword [base + disp], type.
+static void storeType(Assembler* as, int base, int32_t disp, ValueType type) {
+  emitRex(as, false, 0, base);
+  emit(as, 0xc7);
+  emitMem(as, 0, base, disp + TYPE_OFFSET);
+  emit32(as, type);
+}
+
+static void guardNumber(Assembler* as, int base, int32_t disp, int offset) {
+  compareType(as, base, disp, VAL_NUMBER);
+  guard(as, CC_NE, offset);
+}
+
+static void loadNumber(Assembler* as, int xmm, int base, int32_t disp) {
+  sseMem(as, 0xf2, 0x10, xmm, base, disp + AS_OFFSET); // movsd
+}
+
+// Stores the number in xmm0.
+static void storeNumber(Assembler* as, int base, int32_t disp) {
+  storeType(as, base, disp, VAL_NUMBER);
+  sseMem(as, 0xf2, 0x11, 0, base, disp + AS_OFFSET); // movsd
+}
+
+// Stores the boolean in al.
+static void storeBool(Assembler* as, int base, int32_t disp) {
+  storeType(as, base, disp, VAL_BOOL);
+  sseReg(as, 0, 0xb6, RAX, RAX); // movzx eax, al
+  store(as, base, disp + AS_OFFSET, RAX);
+}
+
+// Leaves 1 in eax if the value is true and 0 if it is false.
+static void guardBool(Assembler* as, int base, int32_t disp, int offset) {
+  compareType(as, base, disp, VAL_BOOL);
+  guard(as, CC_NE, offset);
+  emitRex(as, false, RAX, base); // movzx eax, byte [base + disp]
+  emit(as, 0x0f);
+  emit(as, 0xb6);
+  emitMem(as, RAX, base, disp + AS_OFFSET);
+}
+
+static void guardDefined(Assembler* as, int base, int32_t disp, int offset) {
+  compareType(as, base, disp, VAL_UNDEFINED);
+  guard(as, CC_E, offset);
+}
+
+static void copyValue(Assembler* as, int dst, int32_t dstDisp, int src,
+                      int32_t srcDisp) {
+  sseMem(as, 0, 0x10, 0, src, srcDisp); // movups
+  sseMem(as, 0, 0x11, 0, dst, dstDisp); // movups
+}
+
+static void storeValue(Assembler* as, int base, int32_t disp, Value value) {
+  uint64_t words[2] = {0, 0};
+  memcpy(words, &value, sizeof(Value));
+  loadImm(as, RAX, words[0]);
+  store(as, base, disp, RAX);
+  loadImm(as, RAX, words[1]);
+  store(as, base, disp + 8, RAX);
+}
+
+#undef TYPE_OFFSET
+#undef AS_OFFSET
+
+#endif
+
+// Instructions --------------------------------------------------------------
+
+// An operand of an arithmetic or comparison instruction: either a Value in
+// memory or a numeric constant.
+typedef struct {
+  bool isConstant;
+  int base;
+  int32_t disp;
+  double number;
+} Operand;
+
+static Operand stackOperand(int distance) {
+  return (Operand){false, RBX, -distance * VALUE_SIZE, 0};
+}
+
+static Operand localOperand(int slot) {
+  return (Operand){false, R12, slot * VALUE_SIZE, 0};
+}
+
+// Reads a constant operand. Returns false if the constant isn't a number.
+static bool constantOperand(Assembler* as, int constant, Operand* operand) {
+  Value value = as->function->chunk.constants.values[constant];
+  if (!IS_NUMBER(value)) return false;
+  *operand = (Operand){true, 0, 0, AS_NUMBER(value)};
+  return true;
+}
+
+// Loads the numeric [operand] into xmm[xmm], exiting to the interpreter at
+// [offset] if it isn't a number.
+static void loadOperand(Assembler* as, int xmm, Operand operand, int offset) {
+  if (operand.isConstant) {
+    uint64_t bits;
+    memcpy(&bits, &operand.number, sizeof(bits));
+    loadImm(as, RAX, bits);
+    emit(as, 0x66); // movq xmm, rax
+    emit(as, 0x48);
+    sseReg(as, 0, 0x6e, xmm, RAX);
+    return;
+  }
+  guardNumber(as, operand.base, operand.disp, offset);
+  loadNumber(as, xmm, operand.base, operand.disp);
+}
+
+// Computes [a] <op> [b] into xmm0.
+static void arithmetic(Assembler* as, OpCode op, Operand a, Operand b,
+                       int offset) {
+  loadOperand(as, 0, a, offset);
+  loadOperand(as, 1, b, offset);
+
+  switch (op) {
+  case OP_ADD:
+    sseReg(as, 0xf2, 0x58, 0, 1); // addsd
+    break;
+  case OP_MINUS:
+    sseReg(as, 0xf2, 0x5c, 0, 1); // subsd
+    break;
+  case OP_MULTIPLY:
+    sseReg(as, 0xf2, 0x59, 0, 1); // mulsd
+    break;
+  case OP_DIVIDE:
+    sseReg(as, 0xf2, 0x5e, 0, 1); // divsd
+    break;
+  default:
+    // OP_MODULO works on integers. Leave the divisors that trap in idiv to
+    // the interpreter.
+    sseReg(as, 0xf2, 0x2c, RAX, 0); // cvttsd2si eax, xmm0
+    sseReg(as, 0xf2, 0x2c, RCX, 1); // cvttsd2si ecx, xmm1
+    emit(as, 0x85);                 // test ecx, ecx
+    emit(as, 0xc9);
+    guard(as, CC_E, offset);
+    emit(as, 0x83); // cmp ecx, -1
+    emit(as, 0xf9);
+    emit(as, 0xff);
+    guard(as, CC_E, offset);
+    emit(as, 0x99); // cdq
+    emit(as, 0xf7); // idiv ecx
+    emit(as, 0xf9);
+    sseReg(as, 0xf2, 0x2a, 0, RDX); // cvtsi2sd xmm0, edx
+    break;
+  }
+}
+
+// Compares [a] with [b], leaving the boolean result in al.
+static void compare(Assembler* as, OpCode op, Operand a, Operand b,
+                    int offset) {
+  loadOperand(as, 0, a, offset);
+  loadOperand(as, 1, b, offset);
+
+  switch (op) {
+  case OP_GT:
+    sseReg(as, 0x66, 0x2e, 0, 1); // ucomisd xmm0, xmm1
+    setcc(as, CC_A, RAX);
+    break;
+  case OP_GTE:
+    sseReg(as, 0x66, 0x2e, 0, 1);
+    setcc(as, CC_AE, RAX);
+    break;
+  case OP_LT:
+    sseReg(as, 0x66, 0x2e, 1, 0); // ucomisd xmm1, xmm0
+    setcc(as, CC_A, RAX);
+    break;
+  case OP_LTE:
+    sseReg(as, 0x66, 0x2e, 1, 0);
+    setcc(as, CC_AE, RAX);
+    break;
+  case OP_EQ:
+    // Unordered (NaN) operands are never equal.
+    sseReg(as, 0x66, 0x2e, 0, 1);
+    setcc(as, CC_E, RAX);
+    setcc(as, CC_NP, RCX);
+    emit(as, 0x20); // and al, cl
+    emit(as, 0xc8);
+    break;
+  default:
+    sseReg(as, 0x66, 0x2e, 0, 1);
+    setcc(as, CC_NE, RAX);
+    setcc(as, CC_P, RCX);
+    emit(as, 0x08); // or al, cl
+    emit(as, 0xc8);
+    break;
+  }
+}
+
+static int readShort(uint8_t* ip) { return (uint16_t)(ip[0] << 8 | ip[1]); }
+
+// Returns the length in bytes of the instruction at [offset], or -1 if the
+// JIT doesn't know the instruction.
+static int instructionLength(Chunk* chunk, int offset) {
+  uint8_t* ip = chunk->code + offset;
+  switch (*ip) {
+  case OP_ADD:
+  case OP_ADD_NUM:
+  case OP_ADD_STR:
+  case OP_MINUS:
+  case OP_MULTIPLY:
+  case OP_DIVIDE:
+  case OP_MODULO:
+  case OP_TRUE:
+  case OP_FALSE:
+  case OP_NOT:
+  case OP_GT:
+  case OP_LT:
+  case OP_GTE:
+  case OP_LTE:
+  case OP_EQ:
+  case OP_EQ_NUM:
+  case OP_NEQ:
+  case OP_NEQ_NUM:
+  case OP_POP:
+  case OP_DEBUG:
+  case OP_CLOSE_UPVALUE:
+  case OP_RETURN:
+  case OP_END_MODULE:
+  case OP_EXIT:
+    return 1;
+  case OP_CONSTANT:
+  case OP_ERROR:
+  case OP_POPN:
+  case OP_POP_UNDER:
+  case OP_DEFINE_GLOBAL:
+  case OP_GET_GLOBAL:
+  case OP_GET_LOCAL:
+  case OP_GET_UPVALUE:
+  case OP_SET_UPVALUE:
+  case OP_SET_LOCAL:
+  case OP_STORE_LOCAL:
+  case OP_IMPORT_MODULE:
+  case OP_CALL:
+  case OP_TAIL_CALL:
+  case OP_BUILD_STRING:
+    return 2;
+  case OP_ADD_LOCALS:
+  case OP_ADD_LOCAL_CONSTANT:
+  case OP_MINUS_LOCALS:
+  case OP_MINUS_LOCAL_CONSTANT:
+  case OP_MULTIPLY_LOCALS:
+  case OP_MULTIPLY_LOCAL_CONSTANT:
+  case OP_DIVIDE_LOCALS:
+  case OP_DIVIDE_LOCAL_CONSTANT:
+  case OP_MODULO_LOCALS:
+  case OP_MODULO_LOCAL_CONSTANT:
+  case OP_JUMP:
+  case OP_JUMP_IF_FALSE:
+  case OP_JUMP_IF_TRUE:
+  case OP_MATCH:
+  case OP_LOOP:
+    return 3;
+  case OP_GET_IMPORTED_VARIABLE:
+  case OP_JUMP_IF_NOT_MATCH:
+    return 4;
+  case OP_JUMP_IF_LOCAL_CMP_FALSE:
+  case OP_JUMP_IF_LOCALS_CMP_FALSE:
+    return 6;
+  case OP_CLOSURE: {
+    ObjFunction* function = AS_FUNCTION(chunk->constants.values[ip[1]]);
+    return 2 + 2 * function->upvalueCount;
+  }
+  default:
+    return -1;
+  }
+}
+
+// Returns the generic form of a register-operand arithmetic instruction.
+static OpCode registerOpBase(OpCode op) {
+  switch (op) {
+  case OP_ADD_LOCALS:
+  case OP_ADD_LOCAL_CONSTANT:
+    return OP_ADD;
+  case OP_MINUS_LOCALS:
+  case OP_MINUS_LOCAL_CONSTANT:
+    return OP_MINUS;
+  case OP_MULTIPLY_LOCALS:
+  case OP_MULTIPLY_LOCAL_CONSTANT:
+    return OP_MULTIPLY;
+  case OP_DIVIDE_LOCALS:
+  case OP_DIVIDE_LOCAL_CONSTANT:
+    return OP_DIVIDE;
+  default:
+    return OP_MODULO;
+  }
+}
+
+// Emits the machine code for the instruction at [offset]. Returns false if the
+// instruction must always run in the interpreter.
+static bool compileInstruction(Assembler* as, int offset) {
+  Chunk* chunk = &as->function->chunk;
+  uint8_t* ip = chunk->code + offset;
+  OpCode op = *ip;
+
+  switch (op) {
+  case OP_CONSTANT:
+  case OP_TRUE:
+  case OP_FALSE: {
+    Value value = op == OP_CONSTANT ? chunk->constants.values[ip[1]]
+                                    : OBA_BOOL(op == OP_TRUE);
+    storeValue(as, RBX, 0, value);
+    addImm(as, RBX, VALUE_SIZE);
+    return true;
+  }
+
+  case OP_GET_LOCAL:
+    copyValue(as, RBX, 0, R12, ip[1] * VALUE_SIZE);
+    addImm(as, RBX, VALUE_SIZE);
+    return true;
+
+  case OP_SET_LOCAL:
+  case OP_STORE_LOCAL:
+    // Only numbers are assigned in machine code, since the type check is
+    // trivial for them.
+    guardNumber(as, R12, ip[1] * VALUE_SIZE, offset);
+    guardNumber(as, RBX, -VALUE_SIZE, offset);
+    copyValue(as, R12, ip[1] * VALUE_SIZE, RBX, -VALUE_SIZE);
+    if (op == OP_STORE_LOCAL) addImm(as, RBX, -VALUE_SIZE);
+    return true;
+
+  case OP_GET_GLOBAL: {
+    ValueBuffer* variables = &as->function->module->variables;
+    int32_t disp = ip[1] * VALUE_SIZE;
+
+    // Defining a variable in the module may move its values, so reload them.
+    loadImm(as, RDX, (uint64_t)(uintptr_t)&variables->values);
+    load(as, RDX, RDX, 0);
+    guardDefined(as, RDX, disp, offset);
+    copyValue(as, RBX, 0, RDX, disp);
+    addImm(as, RBX, VALUE_SIZE);
+    return true;
+  }
+
+  case OP_POP:
+    addImm(as, RBX, -VALUE_SIZE);
+    return true;
+
+  case OP_POPN:
+    addImm(as, RBX, -ip[1] * VALUE_SIZE);
+    return true;
+
+  case OP_ADD:
+  case OP_ADD_NUM:
+  case OP_MINUS:
+  case OP_MULTIPLY:
+  case OP_DIVIDE:
+  case OP_MODULO:
+    arithmetic(as, op == OP_ADD_NUM ? OP_ADD : op, stackOperand(2),
+               stackOperand(1), offset);
+    storeNumber(as, RBX, -2 * VALUE_SIZE);
+    addImm(as, RBX, -VALUE_SIZE);
+    return true;
+
+  case OP_ADD_LOCALS:
+  case OP_MINUS_LOCALS:
+  case OP_MULTIPLY_LOCALS:
+  case OP_DIVIDE_LOCALS:
+  case OP_MODULO_LOCALS:
+  case OP_ADD_LOCAL_CONSTANT:
+  case OP_MINUS_LOCAL_CONSTANT:
+  case OP_MULTIPLY_LOCAL_CONSTANT:
+  case OP_DIVIDE_LOCAL_CONSTANT:
+  case OP_MODULO_LOCAL_CONSTANT: {
+    Operand b = localOperand(ip[2]);
+    if (op == OP_ADD_LOCAL_CONSTANT || op == OP_MINUS_LOCAL_CONSTANT ||
+        op == OP_MULTIPLY_LOCAL_CONSTANT || op == OP_DIVIDE_LOCAL_CONSTANT ||
+        op == OP_MODULO_LOCAL_CONSTANT) {
+      if (!constantOperand(as, ip[2], &b)) return false;
+    }
+    arithmetic(as, registerOpBase(op), localOperand(ip[1]), b, offset);
+    storeNumber(as, RBX, 0);
+    addImm(as, RBX, VALUE_SIZE);
+    return true;
+  }
+
+  case OP_GT:
+  case OP_LT:
+  case OP_GTE:
+  case OP_LTE:
+  case OP_EQ:
+  case OP_NEQ:
+    compare(as, op, stackOperand(2), stackOperand(1), offset);
+    storeBool(as, RBX, -2 * VALUE_SIZE);
+    addImm(as, RBX, -VALUE_SIZE);
+    return true;
+
+  case OP_EQ_NUM:
+  case OP_NEQ_NUM:
+    compare(as, op == OP_EQ_NUM ? OP_EQ : OP_NEQ, stackOperand(2),
+            stackOperand(1), offset);
+    storeBool(as, RBX, -2 * VALUE_SIZE);
+    addImm(as, RBX, -VALUE_SIZE);
+    return true;
+
+  case OP_NOT:
+    guardBool(as, RBX, -VALUE_SIZE, offset);
+    emit(as, 0x34); // xor al, 1
+    emit(as, 0x01);
+    storeBool(as, RBX, -VALUE_SIZE);
+    return true;
+
+  case OP_JUMP:
+    jumpTo(as, jmp(as), offset + 3 + readShort(ip + 1));
+    return true;
+
+  case OP_LOOP:
+    jumpTo(as, jmp(as), readShort(ip + 1));
+    return true;
+
+  case OP_JUMP_IF_FALSE:
+  case OP_JUMP_IF_TRUE:
+    guardBool(as, RBX, -VALUE_SIZE, offset);
+    addImm(as, RBX, -VALUE_SIZE);
+    emit(as, 0x85); // test eax, eax
+    emit(as, 0xc0);
+    jumpTo(as, jcc(as, op == OP_JUMP_IF_FALSE ? CC_E : CC_NE),
+           offset + 3 + readShort(ip + 1));
+    return true;
+
+  case OP_JUMP_IF_LOCAL_CMP_FALSE:
+  case OP_JUMP_IF_LOCALS_CMP_FALSE: {
+    Operand b = localOperand(ip[2]);
+    if (op == OP_JUMP_IF_LOCAL_CMP_FALSE && !constantOperand(as, ip[2], &b)) {
+      return false;
+    }
+    compare(as, ip[3], localOperand(ip[1]), b, offset);
+    emit(as, 0x84); // test al, al
+    emit(as, 0xc0);
+    jumpTo(as, jcc(as, CC_E), offset + 6 + readShort(ip + 4));
+    return true;
+  }
+
+  default:
+    return false;
+  }
+}
+
+// Emits a stub that returns to the interpreter at [offset].
+static void emitExit(Assembler* as, int offset) {
+  store(as, R13, offsetof(ObaVM, stackTop), RBX);
+  emit(as, 0xb8); // mov eax, offset
+  emit32(as, offset);
+  bind(as, jmp(as), as->epilogue);
+}
+
+static void emitPrologue(Assembler* as) {
+  emit(as, 0x53); // push rbx
+  emit(as, 0x41); // push r12
+  emit(as, 0x54);
+  emit(as, 0x41); // push r13
+  emit(as, 0x55);
+
+  aluReg(as, ALU_MOV, R13, RDI);
+  aluReg(as, ALU_MOV, R12, RSI);
+  load(as, RBX, R13, offsetof(ObaVM, stackTop));
+
+  emit(as, 0xff); // jmp rdx
+  emit(as, 0xe2);
+
+  as->epilogue = here(as);
+  emit(as, 0x41); // pop r13
+  emit(as, 0x5d);
+  emit(as, 0x41); // pop r12
+  emit(as, 0x5c);
+  emit(as, 0x5b); // pop rbx
+  emit(as, 0xc3); // ret
+}
+
+// Records the generated code in /tmp/perf-<pid>.map, so that profilers like
+// perf can attribute samples in it to [function].
+static void writePerfMap(ObaVM* vm, ObjFunction* function, JitCode* jit) {
+  if (!vm->perfMapEnabled) return;
+
+  if (vm->perfMap == NULL) {
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int)getpid());
+    vm->perfMap = fopen(path, "a");
+    if (vm->perfMap == NULL) {
+      vm->perfMapEnabled = false;
+      return;
+    }
+  }
+
+  fprintf(vm->perfMap, "%lx %lx oba::%s::%s\n", (unsigned long)jit->code,
+          (unsigned long)jit->size, function->module->name->chars,
+          function->name->chars);
+  fflush(vm->perfMap);
+}
+
+// Copies the generated code into a new executable mapping.
+static uint8_t* mapCode(Assembler* as, size_t* size) {
+  size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+  *size = (as->code.count + pageSize - 1) / pageSize * pageSize;
+
+  void* code = mmap(NULL, *size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (code == MAP_FAILED) return NULL;
+
+  memcpy(code, as->code.values, as->code.count);
+  if (mprotect(code, *size, PROT_READ | PROT_EXEC) != 0) {
+    munmap(code, *size);
+    return NULL;
+  }
+  return code;
+}
+
+static bool assemble(Assembler* as) {
+  Chunk* chunk = &as->function->chunk;
+  emitPrologue(as);
+
+  bool compiled = false;
+  int length;
+  for (int offset = 0; offset < chunk->count; offset += length) {
+    length = instructionLength(chunk, offset);
+    if (length < 0) return false;
+
+    as->entries[offset] = here(as);
+    if (compileInstruction(as, offset)) {
+      compiled = true;
+    } else {
+      emitExit(as, offset);
+    }
+  }
+
+  // Don't bother running code that does nothing but exit.
+  if (!compiled) return false;
+
+  for (int i = 0; i < as->jumps.count; i++) {
+    Fixup* jump = &as->jumps.values[i];
+    if (jump->offset >= chunk->count || as->entries[jump->offset] < 0) {
+      return false;
+    }
+    bind(as, jump->at, as->entries[jump->offset]);
+  }
+
+  // Guards are emitted in order, so guards in the same instruction share a
+  // stub.
+  int stub = -1;
+  int stubOffset = -1;
+  for (int i = 0; i < as->exits.count; i++) {
+    Fixup* exit = &as->exits.values[i];
+    if (exit->offset != stubOffset) {
+      stub = here(as);
+      stubOffset = exit->offset;
+      emitExit(as, exit->offset);
+    }
+    bind(as, exit->at, stub);
+  }
+  return true;
+}
+
+// JIT public APIs -----------------------------------------------------------
+
+bool obaJitCompile(ObaVM* vm, ObjFunction* function) {
+  Chunk* chunk = &function->chunk;
+
+  Assembler as;
+  as.vm = vm;
+  as.function = function;
+  as.epilogue = 0;
+  initByteBuffer(&as.code);
+  initFixupBuffer(&as.jumps);
+  initFixupBuffer(&as.exits);
+  as.entries = ALLOCATE(vm, int, chunk->count);
+  for (int i = 0; i < chunk->count; i++) as.entries[i] = -1;
+
+  uint8_t* code = NULL;
+  size_t size = 0;
+  if (assemble(&as)) code = mapCode(&as, &size);
+
+  freeByteBuffer(vm, &as.code);
+  freeFixupBuffer(vm, &as.jumps);
+  freeFixupBuffer(vm, &as.exits);
+
+  if (code == NULL) {
+    FREE_ARRAY(vm, int, as.entries, chunk->count);
+    return false;
+  }
+
+  JitCode* jit = ALLOCATE(vm, JitCode, 1);
+  jit->code = code;
+  jit->size = size;
+  jit->entries = as.entries;
+  jit->entryCount = chunk->count;
+  function->jit = jit;
+
+  writePerfMap(vm, function, jit);
+  return true;
+}
+
+void obaJitRun(ObaVM* vm) {
+  CallFrame* frame = vm->frame;
+  ObjFunction* function = frame->closure->function;
+  JitCode* jit = function->jit;
+
+  int offset = (int)(frame->ip - function->chunk.code);
+  ASSERT(jit->entries[offset] >= 0, "Entered JIT code mid-instruction");
+
+  JitFn enter = (JitFn)(void*)jit->code;
+  offset = enter(vm, frame->slots, jit->code + jit->entries[offset]);
+  frame->ip = function->chunk.code + offset;
+}
+
+void obaJitFree(ObaVM* vm, ObjFunction* function) {
+  JitCode* jit = function->jit;
+  if (jit == NULL) return;
+
+  munmap(jit->code, jit->size);
+  FREE_ARRAY(vm, int, jit->entries, jit->entryCount);
+  FREE(vm, JitCode, jit);
+  function->jit = NULL;
+}
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef oba_jit_h
+#define oba_jit_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "oba.h"
+#include "oba_function.h"
+
+// The JIT emits x86-64 code for the System V calling convention. On any other
+// target it is compiled out even when OBA_JIT is defined, and every function
+// runs in the interpreter.
+#if defined(OBA_JIT) &&                                                        \
+    !(defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__)))
+#undef OBA_JIT
+#endif
+
+// The number of calls plus loop iterations after which a function is compiled
+// to machine code.
+#ifndef OBA_JIT_THRESHOLD
+#define OBA_JIT_THRESHOLD 1000
+#endif
+
+// The machine code generated for a single function.
+//
+// The code operates directly on the VM's value stack, so the interpreter can
+// pick up exactly where the machine code left off. Any instruction the JIT
+// does not translate, and any operation whose operands fail a type check,
+// returns control to the interpreter at that instruction.
+typedef struct JitCode {
+  // The executable mapping holding the code, and its size in bytes.
+  uint8_t* code;
+  size_t size;
+
+  // The offset into [code] of each instruction, indexed by the instruction's
+  // bytecode offset. Offsets that fall inside an instruction are -1.
+  int* entries;
+  int entryCount;
+} JitCode;
+
+// Compiles [function] to machine code and attaches it to the function.
+//
+// Returns false if the function's bytecode could not be compiled, in which case
+// the function keeps running in the interpreter.
+bool obaJitCompile(ObaVM* vm, ObjFunction* function);
+
+// Runs the current frame's machine code, starting at the frame's instruction
+// pointer. When the machine code hands control back, the frame's instruction
+// pointer is left at the next instruction for the interpreter to execute.
+void obaJitRun(ObaVM* vm);
+
+// Releases the machine code attached to [function].
+void obaJitFree(ObaVM* vm, ObjFunction* function);
+
+#endif
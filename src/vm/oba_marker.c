@@ -0,0 +1,305 @@
+#include <sched.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "oba_common.h"
+#include "oba_marker.h"
+#include "oba_vm.h"
+
+// The number of markers that take part in marking: the VM's thread and every
+// thread that was started.
+#define ACTIVE_MARKERS(pool) ((pool)->threadCount + 1)
+
+// The number of gray objects a marker keeps to itself before it publishes some
+// for idle markers to steal.
+#define PUBLISH_MIN 32
+
+struct Marker {
+  MarkerPool* pool;
+
+  // Objects only this marker pops.
+  GrayStack gray;
+
+  // Objects any marker may steal, guarded by [lock].
+  GrayStack shared;
+  pthread_mutex_t lock;
+
+  // The number of objects in [shared], which other markers read without the
+  // lock. It is only written with the lock held.
+  int sharedCount;
+
+  // The number of objects blackened in the current round.
+  int blackened;
+};
+
+// Moves [count] objects from the bottom of [from] to [to].
+static void moveGray(GrayStack* from, GrayStack* to, int count) {
+  for (int i = 0; i < count; i++) {
+    pushGray(to, from->objects[i]);
+  }
+  from->count -= count;
+  for (int i = 0; i < from->count; i++) {
+    from->objects[i] = from->objects[count + i];
+  }
+}
+
+// Whether [marker] has objects that other markers may steal. Without the lock
+// this is only a hint.
+static bool hasShared(Marker* marker) {
+  return __atomic_load_n(&marker->sharedCount, __ATOMIC_RELAXED) > 0;
+}
+
+// Publishes the size of [marker]'s shared stack after a change. Must be called
+// with the marker's lock held.
+static void updateShared(Marker* marker) {
+  __atomic_store_n(&marker->sharedCount, marker->shared.count,
+                   __ATOMIC_RELAXED);
+}
+
+// Moves half of [marker]'s gray objects to its shared stack, if it is empty.
+static void publish(Marker* marker) {
+  if (hasShared(marker)) return;
+
+  pthread_mutex_lock(&marker->lock);
+  if (marker->shared.count == 0) {
+    // The bottom of the stack was pushed first, so it is the furthest from
+    // what this marker is working on.
+    moveGray(&marker->gray, &marker->shared, marker->gray.count / 2);
+    updateShared(marker);
+  }
+  pthread_mutex_unlock(&marker->lock);
+}
+
+// Takes half of the shared objects of one of the other markers. Returns false
+// if there were none.
+static bool steal(Marker* marker) {
+  MarkerPool* pool = marker->pool;
+  int self = (int)(marker - pool->markers);
+  int count = ACTIVE_MARKERS(pool);
+
+  for (int i = 1; i < count; i++) {
+    Marker* victim = &pool->markers[(self + i) % count];
+    if (!hasShared(victim)) continue;
+
+    pthread_mutex_lock(&victim->lock);
+    int taken = (victim->shared.count + 1) / 2;
+    moveGray(&victim->shared, &marker->gray, taken);
+    updateShared(victim);
+    pthread_mutex_unlock(&victim->lock);
+    if (taken > 0) return true;
+  }
+  return false;
+}
+
+// Waits until another marker publishes work or every marker is idle. Returns
+// false in the latter case.
+static bool waitForWork(Marker* marker) {
+  MarkerPool* pool = marker->pool;
+  int count = ACTIVE_MARKERS(pool);
+  __atomic_add_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+
+  while (true) {
+    if (__atomic_load_n(&pool->idle, __ATOMIC_SEQ_CST) == count) return false;
+
+    for (int i = 0; i < count; i++) {
+      if (!hasShared(&pool->markers[i])) continue;
+
+      __atomic_sub_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+      if (steal(marker)) return true;
+      __atomic_add_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+      break;
+    }
+    sched_yield();
+  }
+}
+
+static void runMarker(Marker* marker) {
+  MarkerPool* pool = marker->pool;
+  marker->blackened = 0;
+
+  while (true) {
+    while (marker->gray.count > 0 && marker->blackened < pool->budget) {
+      Obj* obj = marker->gray.objects[--marker->gray.count];
+      blackenObject(&marker->gray, obj);
+      marker->blackened++;
+
+      if (marker->gray.count >= PUBLISH_MIN &&
+          __atomic_load_n(&pool->idle, __ATOMIC_RELAXED) > 0) {
+        publish(marker);
+      }
+    }
+
+    if (marker->blackened >= pool->budget) {
+      // Leave the rest to the markers that still have budget, or to the next
+      // round.
+      pthread_mutex_lock(&marker->lock);
+      moveGray(&marker->gray, &marker->shared, marker->gray.count);
+      updateShared(marker);
+      pthread_mutex_unlock(&marker->lock);
+      __atomic_add_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+      return;
+    }
+
+    if (!waitForWork(marker)) return;
+  }
+}
+
+static void* runThread(void* argument) {
+  Marker* marker = (Marker*)argument;
+  MarkerPool* pool = marker->pool;
+  int round = 0;
+
+  pthread_mutex_lock(&pool->lock);
+  while (true) {
+    while (pool->round == round && !pool->stopping) {
+      pthread_cond_wait(&pool->start, &pool->lock);
+    }
+    if (pool->stopping) break;
+    round = pool->round;
+    pthread_mutex_unlock(&pool->lock);
+
+    runMarker(marker);
+
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->running == 0) pthread_cond_signal(&pool->done);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+static void stopThreads(MarkerPool* pool) {
+  if (pool->threadCount == 0) return;
+
+  pthread_mutex_lock(&pool->lock);
+  pool->stopping = true;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (int i = 0; i < pool->threadCount; i++) {
+    pthread_join(pool->threads[i], NULL);
+  }
+  pool->threadCount = 0;
+  pool->stopping = false;
+  pool->round = 0;
+}
+
+// Creates the markers and starts their threads.
+static void startThreads(MarkerPool* pool) {
+  pool->markers = realloc(pool->markers, sizeof(Marker) * pool->count);
+  if (pool->markers == NULL) exit(1);
+
+  for (int i = 0; i < pool->count; i++) {
+    Marker* marker = &pool->markers[i];
+    marker->pool = pool;
+    initGrayStack(&marker->gray, pool->vm);
+    initGrayStack(&marker->shared, pool->vm);
+    marker->gray.isShared = true;
+    marker->shared.isShared = true;
+    pthread_mutex_init(&marker->lock, NULL);
+    marker->sharedCount = 0;
+  }
+
+  for (int i = 1; i < pool->count; i++) {
+    // Without the other markers, marker 0 still does all of the work.
+    if (pthread_create(&pool->threads[i - 1], NULL, runThread,
+                       &pool->markers[i]) != 0) {
+      break;
+    }
+    pool->threadCount++;
+  }
+}
+
+static void freeMarkers(MarkerPool* pool) {
+  if (pool->markers == NULL) return;
+
+  for (int i = 0; i < pool->count; i++) {
+    freeGrayStack(&pool->markers[i].gray);
+    freeGrayStack(&pool->markers[i].shared);
+    pthread_mutex_destroy(&pool->markers[i].lock);
+  }
+  free(pool->markers);
+  pool->markers = NULL;
+}
+
+void initMarkerPool(MarkerPool* pool, ObaVM* vm) {
+  pool->vm = vm;
+  pool->threadCount = 0;
+  pool->markers = NULL;
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->start, NULL);
+  pthread_cond_init(&pool->done, NULL);
+  pool->round = 0;
+  pool->running = 0;
+  pool->stopping = false;
+  pool->idle = 0;
+  pool->budget = 0;
+
+#ifdef DEBUG_STRESS_GC
+  // Mark in parallel even on machines with a single core.
+  pool->count = 4;
+#else
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  pool->count = cores < 1 ? 1 : cores;
+  if (pool->count > MARKERS_DEFAULT) pool->count = MARKERS_DEFAULT;
+#endif
+}
+
+void freeMarkerPool(MarkerPool* pool) {
+  stopThreads(pool);
+  freeMarkers(pool);
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->start);
+  pthread_cond_destroy(&pool->done);
+}
+
+void setMarkerCount(MarkerPool* pool, int count) {
+  stopThreads(pool);
+  freeMarkers(pool);
+  if (count < 1) count = 1;
+  if (count > MARKERS_MAX) count = MARKERS_MAX;
+  pool->count = count;
+}
+
+int markInParallel(MarkerPool* pool, GrayStack* gray, int budget) {
+  if (pool->markers == NULL) startThreads(pool);
+  int count = ACTIVE_MARKERS(pool);
+
+  // Deal the gray objects out so every marker starts with some work.
+  for (int i = 0; i < gray->count; i++) {
+    Obj* obj = gray->objects[i];
+    // The barrier may push the object again after this.
+    obj->isRemembered = false;
+    pushGray(&pool->markers[i % count].gray, obj);
+  }
+  gray->count = 0;
+
+  pool->budget = budget / count < 1 ? 1 : budget / count;
+  pool->idle = 0;
+
+  pthread_mutex_lock(&pool->lock);
+  pool->round++;
+  pool->running = pool->threadCount;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->lock);
+
+  runMarker(&pool->markers[0]);
+
+  pthread_mutex_lock(&pool->lock);
+  while (pool->running > 0) {
+    pthread_cond_wait(&pool->done, &pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  int blackened = 0;
+  for (int i = 0; i < count; i++) {
+    Marker* marker = &pool->markers[i];
+    blackened += marker->blackened;
+    moveGray(&marker->gray, gray, marker->gray.count);
+
+    pthread_mutex_lock(&marker->lock);
+    moveGray(&marker->shared, gray, marker->shared.count);
+    updateShared(marker);
+    pthread_mutex_unlock(&marker->lock);
+  }
+  return blackened;
+}
@@ -0,0 +1,82 @@
+#ifndef oba_marker_h
+#define oba_marker_h
+
+#include <pthread.h>
+#include <stdbool.h>
+
+#include "oba.h"
+#include "oba_value.h"
+
+// The largest number of threads that mark objects during a collection.
+#define MARKERS_MAX 16
+
+// The default number of markers, if the machine has at least this many cores.
+#define MARKERS_DEFAULT 8
+
+// The number of gray objects at which marking is split across the markers.
+// Below this, the work isn't worth waking the other markers for.
+#ifdef DEBUG_STRESS_GC
+#define PARALLEL_MARK_MIN 16
+#else
+#define PARALLEL_MARK_MIN 1024
+#endif
+
+typedef struct Marker Marker;
+
+// Marks objects on several threads at once.
+//
+// Marker 0 runs on the VM's thread, and the others on threads that the pool
+// starts the first time it marks and keeps until the VM is freed. Each marker
+// traces objects from its own gray stack and publishes part of it in a shared
+// stack when other markers run out of work, which they steal from. The VM's
+// thread waits until every marker has finished, so nothing else touches the
+// heap while they run.
+typedef struct {
+  ObaVM* vm;
+
+  // The number of markers, including the VM's thread.
+  int count;
+
+  // The threads running markers 1 to [count] - 1, if they have been started.
+  int threadCount;
+  pthread_t threads[MARKERS_MAX];
+  Marker* markers;
+
+  pthread_mutex_t lock;
+
+  // Signaled when a new round of marking starts or the threads must exit.
+  pthread_cond_t start;
+
+  // Signaled when the last thread finishes a round of marking.
+  pthread_cond_t done;
+
+  // Incremented for every round of marking, so threads can tell a new round
+  // from a spurious wakeup.
+  int round;
+
+  // The number of threads that haven't finished the current round.
+  int running;
+  bool stopping;
+
+  // The number of markers that have no work of their own, updated atomically.
+  int idle;
+
+  // The number of objects each marker may blacken in the current round.
+  int budget;
+} MarkerPool;
+
+void initMarkerPool(MarkerPool* pool, ObaVM* vm);
+
+// Stops the pool's threads and frees its memory.
+void freeMarkerPool(MarkerPool* pool);
+
+// Sets the number of markers, including the VM's thread. Running threads are
+// stopped and started again the next time the pool marks.
+void setMarkerCount(MarkerPool* pool, int count);
+
+// Blackens objects from [gray] using every marker, until [gray] is empty or
+// about [budget] objects have been blackened. Objects left gray are pushed back
+// onto [gray]. Returns the number of objects blackened.
+int markInParallel(MarkerPool* pool, GrayStack* gray, int budget);
+
+#endif
@@ -1,38 +1,66 @@
-OPCODE(CONSTANT)
-OPCODE(ERROR)
-OPCODE(ADD)
-OPCODE(MINUS)
-OPCODE(MULTIPLY)
-OPCODE(DIVIDE)
-OPCODE(MODULO)
-OPCODE(TRUE)
-OPCODE(FALSE)
-OPCODE(NOT)
-OPCODE(GT)
-OPCODE(LT)
-OPCODE(GTE)
-OPCODE(LTE)
-OPCODE(EQ)
-OPCODE(NEQ)
-OPCODE(STRING)
-OPCODE(POP)
-OPCODE(DEBUG)
-OPCODE(DEFINE_GLOBAL)
-OPCODE(GET_GLOBAL)
-OPCODE(GET_LOCAL)
-OPCODE(GET_UPVALUE)
-OPCODE(SET_UPVALUE)
-OPCODE(SET_LOCAL)
-OPCODE(IMPORT_MODULE)
-OPCODE(GET_IMPORTED_VARIABLE)
-OPCODE(JUMP)
-OPCODE(JUMP_IF_FALSE)
-OPCODE(JUMP_IF_TRUE)
-OPCODE(JUMP_IF_NOT_MATCH)
-OPCODE(LOOP)
-OPCODE(CALL)
-OPCODE(CLOSURE)
-OPCODE(CLOSE_UPVALUE)
-OPCODE(RETURN)
-OPCODE(END_MODULE)
-OPCODE(EXIT)
+// Each instruction is listed with its stack effect: the number of values it
+// pushes minus the number it pops. The compiler uses these to compute how much
+// stack a function needs. Instructions that push or pop a number of values
+// given by an operand (POPN, POP_UNDER, JUMP_IF_NOT_MATCH, CALL, TAIL_CALL,
+// BUILD_STRING) list only their fixed part, and the compiler accounts for the
+// rest.
+
+OPCODE(CONSTANT, 1)
+OPCODE(ERROR, 0)
+OPCODE(ADD, -1)
+OPCODE(ADD_NUM, -1)
+OPCODE(ADD_STR, -1)
+OPCODE(ADD_LOCALS, 1)
+OPCODE(ADD_LOCAL_CONSTANT, 1)
+OPCODE(MINUS, -1)
+OPCODE(MINUS_LOCALS, 1)
+OPCODE(MINUS_LOCAL_CONSTANT, 1)
+OPCODE(MULTIPLY, -1)
+OPCODE(MULTIPLY_LOCALS, 1)
+OPCODE(MULTIPLY_LOCAL_CONSTANT, 1)
+OPCODE(DIVIDE, -1)
+OPCODE(DIVIDE_LOCALS, 1)
+OPCODE(DIVIDE_LOCAL_CONSTANT, 1)
+OPCODE(MODULO, -1)
+OPCODE(MODULO_LOCALS, 1)
+OPCODE(MODULO_LOCAL_CONSTANT, 1)
+OPCODE(TRUE, 1)
+OPCODE(FALSE, 1)
+OPCODE(NOT, 0)
+OPCODE(GT, -1)
+OPCODE(LT, -1)
+OPCODE(GTE, -1)
+OPCODE(LTE, -1)
+OPCODE(EQ, -1)
+OPCODE(EQ_NUM, -1)
+OPCODE(NEQ, -1)
+OPCODE(NEQ_NUM, -1)
+OPCODE(BUILD_STRING, 1)
+OPCODE(POP, -1)
+OPCODE(POPN, 0)
+OPCODE(POP_UNDER, 0)
+OPCODE(DEBUG, -1)
+OPCODE(DEFINE_GLOBAL, -1)
+OPCODE(GET_GLOBAL, 1)
+OPCODE(GET_LOCAL, 1)
+OPCODE(GET_UPVALUE, 1)
+OPCODE(SET_UPVALUE, 0)
+OPCODE(SET_LOCAL, 0)
+OPCODE(STORE_LOCAL, -1)
+OPCODE(IMPORT_MODULE, 0)
+OPCODE(GET_IMPORTED_VARIABLE, 0)
+OPCODE(JUMP, 0)
+OPCODE(JUMP_IF_FALSE, -1)
+OPCODE(JUMP_IF_TRUE, -1)
+OPCODE(JUMP_IF_LOCAL_CMP_FALSE, 0)
+OPCODE(JUMP_IF_LOCALS_CMP_FALSE, 0)
+OPCODE(MATCH, 0)
+OPCODE(JUMP_IF_NOT_MATCH, -1)
+OPCODE(LOOP, 0)
+OPCODE(CALL, 0)
+OPCODE(TAIL_CALL, 0)
+OPCODE(CLOSURE, 1)
+OPCODE(CLOSE_UPVALUE, -1)
+OPCODE(RETURN, -1)
+OPCODE(END_MODULE, 1)
+OPCODE(EXIT, 0)
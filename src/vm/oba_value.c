@@ -4,46 +4,180 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "oba_common.h"
+#include "oba_jit.h"
 #include "oba_value.h"
 #include "oba_vm.h"
 
-ObjString* formatCtor(ObaVM* vm, ObjCtor* ctor) {
-  int size = 3 + ctor->family->length + ctor->name->length;
-  if (size > FORMAT_VALUE_MAX) {
-    size = FORMAT_VALUE_MAX;
+// Makes room in [buffer] for at least [count] more bytes.
+static void reserveBytes(ByteBuffer* buffer, int count) {
+  if (buffer->count + count <= buffer->capacity) return;
+
+  int capacity = buffer->capacity;
+  while (capacity < buffer->count + count) {
+    capacity = GROW_CAPACITY(capacity);
   }
-  char buf[size];
-  int length =
-      snprintf(buf, size, "%s::%s", ctor->family->chars, ctor->name->chars);
-  return copyString(vm, buf, length);
+
+  uint8_t* values = realloc(buffer->values, capacity);
+
+  // Fail fast if we can't get the requested memory.
+  if (values == NULL) exit(1);
+  buffer->values = values;
+  buffer->capacity = capacity;
 }
 
-ObjString* formatFunction(ObaVM* vm, ObjFunction* function) {
-  if (function->name != NULL) {
-    int size = 7 + function->module->name->length + function->name->length;
-    if (size > FORMAT_VALUE_MAX) {
-      size = FORMAT_VALUE_MAX;
-    }
-    char buf[size];
-    int length = snprintf(buf, size, "<fn %s::%s>",
-                          function->module->name->chars, function->name->chars);
-    return copyString(vm, buf, length);
-  } else {
-    return copyString(vm, "<fn>", 4);
-  }
+void writeBytes(ByteBuffer* buffer, const char* bytes, int count) {
+  reserveBytes(buffer, count);
+  memcpy(buffer->values + buffer->count, bytes, count);
+  buffer->count += count;
 }
 
-void printFunction(ObjFunction* function) {
-  if (function->name != NULL) {
-    printf("<fn %s::%s>", function->module->name->chars, function->name->chars);
-  } else {
+static void writeChars(ByteBuffer* buffer, const char* chars) {
+  writeBytes(buffer, chars, (int)strlen(chars));
+}
+
+static void writeString(ByteBuffer* buffer, ObjString* string) {
+  reserveBytes(buffer, string->length);
+  copyStringChars(string, (char*)buffer->values + buffer->count);
+  buffer->count += string->length;
+}
+
+static void writeNumber(ByteBuffer* buffer, double number) {
+  // Enough for any number printed with %g, and the terminator snprintf adds.
+  reserveBytes(buffer, 32);
+  buffer->count += snprintf((char*)buffer->values + buffer->count, 32, "%g",
+                            number);
+}
+
+static void writeFunction(ByteBuffer* buffer, ObjFunction* function) {
+  if (function->name == NULL) {
     // The function is still being compiled and this value is being printed
     // while the function is on the stack, probably as a debugging message.
-    printf("<fn>");
+    writeChars(buffer, "<fn>");
+    return;
+  }
+
+  writeChars(buffer, "<fn ");
+  writeString(buffer, function->module->name);
+  writeChars(buffer, "::");
+  writeString(buffer, function->name);
+  writeChars(buffer, ">");
+}
+
+static void writeCtor(ByteBuffer* buffer, ObjCtor* ctor) {
+  writeString(buffer, ctor->family);
+  writeChars(buffer, "::");
+  writeString(buffer, ctor->name);
+}
+
+// Writes any value except an instance.
+static void writeSimpleValue(ByteBuffer* buffer, Value value) {
+  switch (valueType(value)) {
+  case VAL_NUMBER:
+    writeNumber(buffer, AS_NUMBER(value));
+    return;
+  case VAL_BOOL:
+    writeChars(buffer, AS_BOOL(value) ? "true" : "false");
+    return;
+  case VAL_NIL:
+    writeChars(buffer, "nil");
+    return;
+  case VAL_OBJ:
+    break;
+  default:
+    return; // Unreachable.
+  }
+
+  Obj* obj = AS_OBJ(value);
+  switch (obj->type) {
+  case OBJ_STRING:
+    writeString(buffer, (ObjString*)obj);
+    break;
+  case OBJ_CLOSURE:
+    writeFunction(buffer, ((ObjClosure*)obj)->function);
+    break;
+  case OBJ_FUNCTION:
+    writeFunction(buffer, (ObjFunction*)obj);
+    break;
+  case OBJ_NATIVE:
+    writeChars(buffer, "<native fn>");
+    break;
+  case OBJ_UPVALUE:
+    writeValue(buffer, *((ObjUpvalue*)obj)->location);
+    break;
+  case OBJ_MODULE:
+    writeChars(buffer, "<module ");
+    writeString(buffer, ((ObjModule*)obj)->name);
+    writeChars(buffer, ">");
+    break;
+  case OBJ_CTOR:
+    writeCtor(buffer, (ObjCtor*)obj);
+    break;
+  default:
+    break; // Unreachable.
   }
 }
 
+void writeValue(ByteBuffer* buffer, Value value) {
+  // An instance's last field is written by the loop instead of a recursive
+  // call, so long chains of instances such as lists don't exhaust the C stack.
+  // The parentheses that close them are written at the end.
+  int openCount = 0;
+  while (IS_INSTANCE(value)) {
+    ObjInstance* instance = AS_INSTANCE(value);
+    int arity = instance->ctor->arity;
+
+    writeChars(buffer, "(");
+    writeCtor(buffer, instance->ctor);
+    if (arity == 0) {
+      writeChars(buffer, ")");
+      break;
+    }
+
+    for (int i = 0; i < arity - 1; i++) {
+      writeChars(buffer, ",");
+      writeValue(buffer, instance->fields[i]);
+    }
+    writeChars(buffer, ",");
+    value = instance->fields[arity - 1];
+    openCount++;
+  }
+
+  if (!IS_INSTANCE(value)) writeSimpleValue(buffer, value);
+  for (int i = 0; i < openCount; i++) {
+    writeChars(buffer, ")");
+  }
+}
+
+void freeFormatBuffer(ByteBuffer* buffer) {
+  free(buffer->values);
+  initByteBuffer(buffer);
+}
+
+ObjString* formatValue(ObaVM* vm, Value value) {
+  if (IS_STRING(value)) return AS_STRING(value);
+
+  ByteBuffer buffer;
+  initByteBuffer(&buffer);
+  writeValue(&buffer, value);
+  ObjString* string =
+      copyTransientString(vm, (char*)buffer.values, buffer.count);
+  freeFormatBuffer(&buffer);
+  return string;
+}
+
+void printValue(Value value) {
+  ByteBuffer buffer;
+  initByteBuffer(&buffer);
+  writeValue(&buffer, value);
+  fwrite(buffer.values, sizeof(uint8_t), buffer.count, stdout);
+  freeFormatBuffer(&buffer);
+}
+
 const char* objectTypeName(Value value) {
   switch (OBJ_TYPE(value)) {
   case OBJ_STRING:
@@ -81,16 +215,16 @@ bool canAssignObjectType(Value oldValue, Value newValue) {
 }
 
 bool canAssignType(Value oldValue, Value newValue) {
-  switch (oldValue.type) {
+  switch (valueType(oldValue)) {
   case VAL_OBJ:
     return canAssignObjectType(oldValue, newValue);
   default:
-    return oldValue.type == newValue.type;
+    return valueType(oldValue) == valueType(newValue);
   }
 }
 
 const char* valueTypeName(Value value) {
-  switch (value.type) {
+  switch (valueType(value)) {
   case VAL_NIL:
     return "nil";
   case VAL_BOOL:
@@ -104,128 +238,6 @@ const char* valueTypeName(Value value) {
   }
 }
 
-ObjString* formatValue(ObaVM*, Value);
-
-ObjString* formatModule(ObaVM* vm, ObjModule* module) {
-  int size = FORMAT_VALUE_MAX;
-  if (module->name->length < size) {
-    size = module->name->length;
-  }
-  char buf[size];
-  int length = snprintf(buf, size, "<module %s>", module->name->chars);
-  return copyString(vm, buf, size);
-}
-
-ObjString* formatInstance(ObaVM* vm, ObjInstance* instance) {
-  StringBuffer buffer;
-  initStringBuffer(&buffer);
-
-  writeStringBuffer(vm, &buffer, copyString(vm, "(", 1));
-  writeStringBuffer(vm, &buffer, formatCtor(vm, instance->ctor));
-  writeStringBuffer(vm, &buffer, copyString(vm, ",", 1));
-
-  int field = 0;
-  while (field < instance->ctor->arity) {
-    ObjString* fieldString = formatValue(vm, instance->fields[field]);
-    writeStringBuffer(vm, &buffer, fieldString);
-    if (field + 1 < instance->ctor->arity) {
-      writeStringBuffer(vm, &buffer, copyString(vm, ",", 1));
-    }
-    field++;
-  }
-  writeStringBuffer(vm, &buffer, copyString(vm, ")", 1));
-
-  // Concatenate the array into a single string.
-  int fullsize = 0;
-  for (int i = 0; i < buffer.count; i++) {
-    fullsize += buffer.values[i]->length;
-  }
-
-  char* string = ALLOCATE(vm, char, fullsize + 1);
-  string[0] = '\0';
-  for (int i = 0; i < buffer.count; i++) {
-    strcat(string, buffer.values[i]->chars);
-  }
-
-  freeStringBuffer(vm, &buffer);
-  return takeString(vm, string, fullsize);
-}
-
-ObjString* formatObject(ObaVM* vm, Obj* obj) {
-  switch (obj->type) {
-  case OBJ_CLOSURE:
-    return formatFunction(vm, ((ObjClosure*)obj)->function);
-  case OBJ_FUNCTION:
-    return formatFunction(vm, (ObjFunction*)obj);
-  case OBJ_STRING:
-    return (ObjString*)obj;
-  case OBJ_NATIVE:
-    return copyString(vm, "<native fn>", 11);
-  case OBJ_UPVALUE:
-    return formatValue(vm, *((ObjUpvalue*)obj)->location);
-  case OBJ_MODULE:
-    return formatModule(vm, (ObjModule*)obj);
-  case OBJ_INSTANCE: {
-    return formatInstance(vm, (ObjInstance*)obj);
-  }
-  default:
-    return NULL; // Unreachable
-  }
-}
-
-void printCtor(ObjCtor* ctor) {
-  printf("%s::%s", ctor->family->chars, ctor->name->chars);
-}
-
-void printObject(Value value) {
-  Obj* obj = AS_OBJ(value);
-  switch (obj->type) {
-  case OBJ_CLOSURE:
-    printFunction(AS_CLOSURE(value)->function);
-    break;
-  case OBJ_FUNCTION:
-    printFunction(AS_FUNCTION(value));
-    break;
-  case OBJ_STRING:
-    printf("%s", AS_CSTRING(value));
-    break;
-  case OBJ_NATIVE:
-    printf("<native fn>");
-    break;
-  case OBJ_UPVALUE:
-    printValue(*(AS_UPVALUE(value)->location));
-    break;
-  case OBJ_MODULE: {
-    ObjModule* module = (ObjModule*)obj;
-    printf("<module %s>", module->name->chars);
-    break;
-  }
-  case OBJ_CTOR: {
-    printCtor(AS_CTOR(value));
-    break;
-  }
-  case OBJ_INSTANCE: {
-    ObjInstance* instance = (ObjInstance*)obj;
-    printf("(");
-    printCtor(instance->ctor);
-
-    int fields = instance->ctor->arity;
-    if (fields > 0) {
-      printf(",");
-      for (int i = 0; i < fields; i++) {
-        printValue(instance->fields[i]);
-        if (i + 1 < fields) {
-          printf(",");
-        }
-      }
-    }
-    printf(")");
-  }
-  default:
-    break; // Unreachable
-  }
-}
-
 Obj* allocateObject(ObaVM* vm, size_t size, ObjType type) {
   Obj* obj = (Obj*)reallocate(vm, NULL, 0, size);
   memset(obj, 0, size);
@@ -236,22 +248,31 @@ Obj* allocateObject(ObaVM* vm, size_t size, ObjType type) {
 
   obj->type = type;
   obj->next = vm->objects;
-  obj->isMarked = false;
+  obj->mark = !vm->markColor;
   vm->objects = obj;
+
+  // Objects allocated while a full collection is marking are traced by it
+  // once they are initialized, by the next slice at the earliest.
+  if (vm->gcPhase == GC_MARK) {
+    obj->mark = vm->markColor;
+    obaPushGray(vm, obj);
+  }
   return obj;
 }
 
 void freeObject(ObaVM* vm, Obj* obj) {
 #ifdef DEBUG_LOG_GC
   printf("@%p free object type: %d\n", (void*)obj, obj->type);
-  printObject(OBJ_VAL(obj));
+  printValue(OBJ_VAL(obj));
   printf("\n");
 #endif
 
   switch (obj->type) {
   case OBJ_STRING: {
     ObjString* string = (ObjString*)obj;
-    FREE_ARRAY(vm, char, string->chars, string->length + 1);
+    if (string->chars != NULL) {
+      FREE_ARRAY(vm, char, string->chars, string->length + 1);
+    }
     FREE(vm, ObjString, obj);
     break;
   }
@@ -260,6 +281,9 @@ void freeObject(ObaVM* vm, Obj* obj) {
     break;
   case OBJ_FUNCTION: {
     ObjFunction* function = (ObjFunction*)obj;
+#ifdef OBA_JIT
+    obaJitFree(vm, function);
+#endif
     freeChunk(vm, &function->chunk);
     FREE(vm, ObjFunction, obj);
     break;
@@ -275,8 +299,9 @@ void freeObject(ObaVM* vm, Obj* obj) {
     break;
   case OBJ_MODULE: {
     ObjModule* module = (ObjModule*)obj;
-    freeTable(vm, module->variables);
-    free(module->variables);
+    freeValueBuffer(vm, &module->variables);
+    freeStringBuffer(vm, &module->variableNames);
+    freeTable(vm, &module->variableSlots);
     FREE(vm, ObjModule, obj);
     break;
   }
@@ -284,9 +309,10 @@ void freeObject(ObaVM* vm, Obj* obj) {
     FREE(vm, ObjCtor, obj);
     break;
   case OBJ_INSTANCE: {
+    // An instance is always newer than its constructor, so the constructor is
+    // freed after it.
     ObjInstance* instance = (ObjInstance*)obj;
-    FREE_ARRAY(vm, Value, instance->fields, instance->ctor->arity);
-    FREE(vm, ObjInstance, obj);
+    FREE_FLEX(vm, ObjInstance, Value, instance->ctor->arity, obj);
     break;
   }
   }
@@ -301,25 +327,43 @@ ObjString* allocateString(ObaVM* vm, char* chars, int length, uint32_t hash) {
   string->length = length;
   string->chars = chars;
   string->hash = hash;
+  string->hasHash = true;
 
   obaPushRoot(vm, (Obj*)string);
   tableSet(vm, vm->strings, string, NIL_VAL);
   obaPopRoot(vm);
 
+  obaAddYoungString(vm, string);
   return string;
 }
 
-// FNV-1a hash function
-// https://en.wikipedia.org/wiki/Fowler%E2%80%93Noll%E2%80%93Vo_hash_function.
+// Hashes [length] bytes at [key] a word at a time. Each word is mixed into the
+// hash with a rotate, xor and multiply, and the result is finalized with the
+// MurmurHash3 64-bit finalizer so every bit of the input affects the low bits
+// that choose the table group.
 static uint32_t hashString(const char* key, int length) {
-  uint32_t hash = 2166136261u;
+  uint64_t hash = (uint64_t)length;
+
+  while (length >= 8) {
+    uint64_t word;
+    memcpy(&word, key, sizeof(word));
+    hash = ((hash << 5 | hash >> 59) ^ word) * 0x517cc1b727220a95u;
+    key += 8;
+    length -= 8;
+  }
 
-  for (int i = 0; i < length; i++) {
-    hash ^= key[i];
-    hash *= 16777619;
+  if (length > 0) {
+    uint64_t word = 0;
+    memcpy(&word, key, length);
+    hash = ((hash << 5 | hash >> 59) ^ word) * 0x517cc1b727220a95u;
   }
 
-  return hash;
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdu;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53u;
+  hash ^= hash >> 33;
+  return (uint32_t)hash;
 }
 
 static ObjString* tableFindString(Table* table, const char* chars, int length,
@@ -351,9 +395,33 @@ ObjString* takeString(ObaVM* vm, char* chars, int length) {
   return allocateString(vm, chars, length, hash);
 }
 
+ObjString* copyTransientString(ObaVM* vm, const char* chars, int length) {
+  char* heapChars = ALLOCATE(vm, char, length + 1);
+  memcpy(heapChars, chars, length);
+  heapChars[length] = '\0';
+  return takeTransientString(vm, heapChars, length);
+}
+
+ObjString* takeTransientString(ObaVM* vm, char* chars, int length) {
+  ObjString* string = ALLOCATE_OBJ(vm, ObjString, OBJ_STRING);
+  string->length = length;
+  string->chars = chars;
+  return string;
+}
+
+uint32_t stringHash(ObjString* string) {
+  ASSERT(string->chars != NULL, "Ropes must be flattened before hashing");
+  if (!string->hasHash) {
+    string->hash = hashString(string->chars, string->length);
+    string->hasHash = true;
+  }
+  return string->hash;
+}
+
 ObjString* trimString(ObaVM* vm, ObjString* string) {
   if (string->length == 0) return string;
 
+  flattenString(vm, string);
   char* start = string->chars;
   char* end = start + string->length - 1;
   bool trimming = true;
@@ -370,8 +438,62 @@ ObjString* trimString(ObaVM* vm, ObjString* string) {
     }
   }
 
-  if (start > end || isspace(*start)) return copyString(vm, "", 0);
-  return copyString(vm, start, (int)(end - start + 1));
+  if (start > end || isspace(*start)) return copyTransientString(vm, "", 0);
+  return copyTransientString(vm, start, (int)(end - start + 1));
+}
+
+ObjString* concatenateStrings(ObaVM* vm, ObjString* left, ObjString* right) {
+  int length = left->length + right->length;
+
+  if (length < ROPE_MIN_LENGTH || left->length == 0 || right->length == 0) {
+    char* chars = ALLOCATE(vm, char, length + 1);
+    copyStringChars(left, chars);
+    copyStringChars(right, chars + left->length);
+    chars[length] = '\0';
+    return takeTransientString(vm, chars, length);
+  }
+
+  ObjString* rope = ALLOCATE_OBJ(vm, ObjString, OBJ_STRING);
+  rope->length = length;
+  rope->chars = NULL;
+  rope->left = left;
+  rope->right = right;
+  return rope;
+}
+
+void copyStringChars(ObjString* string, char* chars) {
+  // Recurse into the shorter half and loop on the longer one, so the depth of
+  // the recursion is at most logarithmic in the length of the string, however
+  // unbalanced the rope is.
+  while (string->chars == NULL) {
+    ObjString* left = string->left;
+    ObjString* right = string->right;
+    if (left->length <= right->length) {
+      copyStringChars(left, chars);
+      chars += left->length;
+      string = right;
+    } else {
+      copyStringChars(right, chars + left->length);
+      string = left;
+    }
+  }
+
+  memcpy(chars, string->chars, string->length);
+}
+
+ObjString* flattenString(ObaVM* vm, ObjString* string) {
+  if (string->chars != NULL) return string;
+
+  char* chars = ALLOCATE(vm, char, string->length + 1);
+  copyStringChars(string, chars);
+  chars[string->length] = '\0';
+
+  // The rope no longer needs its halves, which can be collected unless
+  // something else holds on to them.
+  string->chars = chars;
+  string->left = NULL;
+  string->right = NULL;
+  return string;
 }
 
 ObjNative* newNative(ObaVM* vm, NativeFn function) {
@@ -385,18 +507,51 @@ ObjModule* newModule(ObaVM* vm, ObjString* name) {
 
   ObjModule* module = ALLOCATE_OBJ(vm, ObjModule, OBJ_MODULE);
   module->name = name;
+  initValueBuffer(&module->variables);
+  initStringBuffer(&module->variableNames);
+  initTable(&module->variableSlots);
 
   obaPopRoot(vm);
+  return module;
+}
+
+int findModuleVariable(ObjModule* module, ObjString* name) {
+  Value slot;
+  if (!tableGet(&module->variableSlots, name, &slot)) return -1;
+  return (int)AS_NUMBER(slot);
+}
+
+int declareModuleVariable(ObaVM* vm, ObjModule* module, ObjString* name) {
+  int slot = findModuleVariable(module, name);
+  if (slot >= 0) return slot;
+
   obaPushRoot(vm, (Obj*)module);
+  obaPushRoot(vm, (Obj*)name);
 
-  module->variables = (Table*)reallocate(vm, NULL, 0, sizeof(Table));
-  initTable(module->variables);
+  slot = module->variables.count;
+  writeStringBuffer(vm, &module->variableNames, name);
+  writeValueBuffer(vm, &module->variables, UNDEFINED_VAL);
+  tableSet(vm, &module->variableSlots, name, OBA_NUMBER((double)slot));
+  WRITE_BARRIER(vm, module);
 
-  obaPopRoot(vm);
-  return module;
+  obaPopRoot(vm); // name.
+  obaPopRoot(vm); // module.
+  return slot;
 }
 
-ObjCtor* newCtor(ObaVM* vm, ObjString* family, ObjString* name, int arity) {
+int defineModuleVariable(ObaVM* vm, ObjModule* module, ObjString* name,
+                         Value value) {
+  if (IS_OBJ(value)) obaPushRoot(vm, AS_OBJ(value));
+  int slot = declareModuleVariable(vm, module, name);
+  if (IS_OBJ(value)) obaPopRoot(vm);
+
+  module->variables.values[slot] = value;
+  WRITE_BARRIER(vm, module);
+  return slot;
+}
+
+ObjCtor* newCtor(ObaVM* vm, ObjString* family, ObjString* name, int arity,
+                 int tag) {
   obaPushRoot(vm, (Obj*)family);
   obaPushRoot(vm, (Obj*)name);
 
@@ -408,31 +563,56 @@ ObjCtor* newCtor(ObaVM* vm, ObjString* family, ObjString* name, int arity) {
   ctor->family = family;
   ctor->name = name;
   ctor->arity = arity;
+  ctor->tag = tag;
+  ctor->instance = NULL;
   return ctor;
 }
 
 ObjInstance* newInstance(ObaVM* vm, ObjCtor* ctor) {
   obaPushRoot(vm, (Obj*)ctor);
 
-  // Allocate the fields before the ObjInstance, in-case a GC is triggered and
-  // we attempt to print the instance, which would iterate over a null pointer.
-  Value* fields = ALLOCATE(vm, Value, ctor->arity);
-  ObjInstance* instance = ALLOCATE_OBJ(vm, ObjInstance, OBJ_INSTANCE);
+  // The fields are zeroed, which the GC skips, so a collection triggered
+  // before they are set doesn't follow garbage.
+  ObjInstance* instance =
+      ALLOCATE_FLEX_OBJ(vm, ObjInstance, Value, ctor->arity, OBJ_INSTANCE);
   instance->ctor = ctor;
-  instance->fields = fields;
 
   obaPopRoot(vm); // ctor.
   return instance;
 }
 
+// Returns true if [a] and [b], which have the same length and at least one of
+// which is an unflattened rope, have the same characters.
+static bool ropesEqual(ObjString* a, ObjString* b) {
+  // Comparisons have no VM to allocate with and their operands may not be
+  // reachable, so the ropes are copied into temporary buffers.
+  char* aChars = malloc(a->length);
+  char* bChars = malloc(b->length);
+  if (aChars == NULL || bChars == NULL) exit(1);
+
+  copyStringChars(a, aChars);
+  copyStringChars(b, bChars);
+  bool equal = memcmp(aChars, bChars, a->length) == 0;
+
+  free(aChars);
+  free(bChars);
+  return equal;
+}
+
 bool objectsEqual(Value ao, Value bo) {
+  if (AS_OBJ(ao) == AS_OBJ(bo)) return true;
   if (OBJ_TYPE(ao) != OBJ_TYPE(bo)) return false;
 
   switch (OBJ_TYPE(ao)) {
   case OBJ_STRING: {
     ObjString* a = AS_STRING(ao);
     ObjString* b = AS_STRING(bo);
-    return a->length == b->length && strcmp(a->chars, b->chars) == 0;
+    if (a->length != b->length) return false;
+    if (a->hasHash && b->hasHash && a->hash != b->hash) return false;
+    if (a->chars != NULL && b->chars != NULL) {
+      return memcmp(a->chars, b->chars, a->length) == 0;
+    }
+    return ropesEqual(a, b);
   }
   case OBJ_FUNCTION: {
     ObjFunction* a = AS_FUNCTION(ao);
@@ -463,9 +643,9 @@ bool objectsEqual(Value ao, Value bo) {
 }
 
 bool valuesEqual(Value a, Value b) {
-  if (a.type != b.type) return false;
+  if (valueType(a) != valueType(b)) return false;
 
-  switch (a.type) {
+  switch (valueType(a)) {
   case VAL_BOOL:
     return AS_BOOL(a) == AS_BOOL(b);
   case VAL_NUMBER:
@@ -473,79 +653,35 @@ bool valuesEqual(Value a, Value b) {
   case VAL_OBJ:
     return objectsEqual(a, b);
   case VAL_NIL:
-    return b.type == VAL_NIL;
+    return true;
   default:
     return false; // Unreachable.
   }
 }
 
-ObjString* formatNumber(ObaVM* vm, Value value) {
-  char buf[FORMAT_VALUE_MAX];
-  int length = snprintf(buf, FORMAT_VALUE_MAX, "%g", AS_NUMBER(value));
-  return copyString(vm, buf, length);
-}
-
-ObjString* formatBool(ObaVM* vm, Value value) {
-  return AS_BOOL(value) ? copyString(vm, "true", 4)
-                        : copyString(vm, "false", 5);
-}
-
-ObjString* formatValue(ObaVM* vm, Value value) {
-  switch (value.type) {
-  case VAL_NUMBER:
-    return formatNumber(vm, value);
-  case VAL_BOOL:
-    return formatBool(vm, value);
-  case VAL_NIL:
-    return copyString(vm, "nil", 3);
-  case VAL_OBJ:
-    return formatObject(vm, AS_OBJ(value));
-  default:
-    return NULL; // Unreachable
-  }
-}
-
-void printValue(Value value) {
-  switch (value.type) {
-  case VAL_NUMBER:
-    printf("%g", AS_NUMBER(value));
-    break;
-  case VAL_BOOL:
-    printf(AS_BOOL(value) ? "true" : "false");
-    break;
-  case VAL_OBJ:
-    printObject(value);
-    break;
-  case VAL_NIL:
-    printf("nil");
-    break;
-  default:
-    return; // Unreachable
-  }
-}
-
-void obaGrayStringBuffer(ObaVM* vm, StringBuffer* buf) {
+static void grayStringBuffer(GrayStack* gray, StringBuffer* buf) {
   for (int i = 0; i < buf->count; i++) {
-    obaGrayObject(vm, (Obj*)buf->values[i]);
+    grayObject(gray, (Obj*)buf->values[i]);
   }
 }
 
-void obaGrayValueBuffer(ObaVM* vm, ValueBuffer* buf) {
+static void grayValueBuffer(GrayStack* gray, ValueBuffer* buf) {
   for (int i = 0; i < buf->count; i++) {
-    obaGrayValue(vm, buf->values[i]);
+    grayValue(gray, buf->values[i]);
   }
 }
 
-void obaGrayTable(ObaVM* vm, Table* table) {
+static void grayTable(GrayStack* gray, Table* table) {
   if (table == NULL) return;
   for (int i = 0; i < table->capacity; i++) {
     Entry* entry = &table->entries[i];
-    obaGrayObject(vm, (Obj*)entry->key);
-    obaGrayValue(vm, entry->value);
+    if (entry->key == NULL) continue;
+    grayObject(gray, (Obj*)entry->key);
+    grayValue(gray, entry->value);
   }
 }
 
-void blackenObject(ObaVM* vm, Obj* obj) {
+void blackenObject(GrayStack* gray, Obj* obj) {
 #ifdef DEBUG_LOG_GC
   printf("@%p blacken ", (void*)obj);
   printValue(OBJ_VAL(obj));
@@ -553,76 +689,87 @@ void blackenObject(ObaVM* vm, Obj* obj) {
 #endif
 
   switch (obj->type) {
+  case OBJ_STRING: {
+    ObjString* string = (ObjString*)obj;
+    grayObject(gray, (Obj*)string->left);
+    grayObject(gray, (Obj*)string->right);
+    break;
+  }
   case OBJ_NATIVE:
-  case OBJ_STRING:
     break;
   case OBJ_CLOSURE: {
     ObjClosure* closure = (ObjClosure*)obj;
-    obaGrayObject(vm, (Obj*)closure->function);
+    grayObject(gray, (Obj*)closure->function);
     if (closure->upvalues != NULL) {
       for (int i = 0; i < closure->upvalueCount; i++) {
-        obaGrayObject(vm, (Obj*)closure->upvalues[i]);
+        grayObject(gray, (Obj*)closure->upvalues[i]);
       }
     }
     break;
   }
   case OBJ_FUNCTION: {
     ObjFunction* function = (ObjFunction*)obj;
-    obaGrayObject(vm, (Obj*)function->name);
-    obaGrayObject(vm, (Obj*)function->module);
-    obaGrayValueBuffer(vm, &function->chunk.constants);
+    grayObject(gray, (Obj*)function->name);
+    grayObject(gray, (Obj*)function->module);
+    grayValueBuffer(gray, &function->chunk.constants);
+    for (int i = 0; i < function->chunk.importCaches.count; i++) {
+      grayObject(gray, (Obj*)function->chunk.importCaches.values[i].module);
+    }
     break;
   }
   case OBJ_UPVALUE: {
     ObjUpvalue* upvalue = (ObjUpvalue*)obj;
-    obaGrayValue(vm, upvalue->closed);
+    grayValue(gray, upvalue->closed);
     // No need to mark upvalue->location; It's on the stack, so it's marked as a
     // GC root by the VM.
     break;
   }
   case OBJ_MODULE: {
     ObjModule* module = (ObjModule*)obj;
-    obaGrayTable(vm, module->variables);
-    obaGrayObject(vm, (Obj*)module->name);
+    grayValueBuffer(gray, &module->variables);
+    grayStringBuffer(gray, &module->variableNames);
+    grayTable(gray, &module->variableSlots);
+    grayObject(gray, (Obj*)module->name);
     break;
   }
   case OBJ_CTOR: {
     ObjCtor* ctor = (ObjCtor*)obj;
-    obaGrayObject(vm, (Obj*)ctor->name);
-    obaGrayObject(vm, (Obj*)ctor->family);
+    grayObject(gray, (Obj*)ctor->name);
+    grayObject(gray, (Obj*)ctor->family);
+    grayObject(gray, (Obj*)ctor->instance);
     break;
   }
   case OBJ_INSTANCE: {
     ObjInstance* instance = (ObjInstance*)obj;
-    obaGrayObject(vm, (Obj*)instance->ctor);
-    if (instance->fields != NULL) {
-      for (int i = 0; i < instance->ctor->arity; i++) {
-        obaGrayValue(vm, instance->fields[i]);
-      }
+    grayObject(gray, (Obj*)instance->ctor);
+    for (int i = 0; i < instance->ctor->arity; i++) {
+      grayValue(gray, instance->fields[i]);
     }
     break;
   }
   }
 }
 
-void obaGrayObject(ObaVM* vm, Obj* obj) {
-  if (obj == NULL) return;
-  if (obj->isMarked) return;
-#ifdef DEBUG_LOG_GC
-  printf("@%p mark ", (void*)obj);
-  printValue(OBJ_VAL(obj));
-  printf("\n");
-#endif
+void initGrayStack(GrayStack* gray, ObaVM* vm) {
+  gray->vm = vm;
+  gray->count = 0;
+  gray->capacity = 0;
+  gray->objects = NULL;
+  gray->isShared = false;
+}
 
-  obj->isMarked = true;
+void freeGrayStack(GrayStack* gray) {
+  free(gray->objects);
+  initGrayStack(gray, gray->vm);
+}
 
-  // TOOD(kendal): Why not use an ObjectBuffer (dynamic array) here?
-  if (vm->grayCapacity < vm->grayCount + 1) {
-    vm->grayCapacity = GROW_CAPACITY(vm->grayCapacity);
+void pushGray(GrayStack* gray, Obj* obj) {
+  if (gray->capacity < gray->count + 1) {
+    gray->capacity = GROW_CAPACITY(gray->capacity);
     // realloc directly to avoid triggering a recursive GC.
-    vm->grayStack = realloc(vm->grayStack, sizeof(Obj*) * vm->grayCapacity);
+    gray->objects = realloc(gray->objects, sizeof(Obj*) * gray->capacity);
     // If we can't mark objects for GC, just exit.
-    if (vm->grayStack == NULL) {
+    if (gray->objects == NULL) {
 #ifdef DEBUG_LOG_GC
       fprintf(stderr, "OOM during GC gray stack allocation\n");
 #endif
@@ -630,124 +777,275 @@ void obaGrayObject(ObaVM* vm, Obj* obj) {
     }
   }
 
-  vm->grayStack[vm->grayCount++] = obj;
+  gray->objects[gray->count++] = obj;
 }
 
-void obaGrayValue(ObaVM* vm, Value value) {
+void grayObject(GrayStack* gray, Obj* obj) {
+  if (obj == NULL) return;
+
+  bool color = gray->vm->markColor;
+  if (gray->isShared) {
+    // Another marker may reach the object at the same time. Only the one that
+    // sets the mark pushes it.
+    if (__atomic_load_n(&obj->mark, __ATOMIC_RELAXED) == color) return;
+    if (__atomic_exchange_n(&obj->mark, color, __ATOMIC_RELAXED) == color) {
+      return;
+    }
+  } else {
+    if (obj->mark == color) return;
+    obj->mark = color;
+  }
+
+#ifdef DEBUG_LOG_GC
+  printf("@%p mark ", (void*)obj);
+  printValue(OBJ_VAL(obj));
+  printf("\n");
+#endif
+  pushGray(gray, obj);
+}
+
+void grayValue(GrayStack* gray, Value value) {
   if (!IS_OBJ(value)) return;
-  obaGrayObject(vm, AS_OBJ(value));
+  grayObject(gray, AS_OBJ(value));
 }
 
+void obaGrayTable(ObaVM* vm, Table* table) { grayTable(&vm->gray, table); }
+
+void obaGrayValue(ObaVM* vm, Value value) { grayValue(&vm->gray, value); }
+
+void obaGrayObject(ObaVM* vm, Obj* obj) { grayObject(&vm->gray, obj); }
+
+void obaPushGray(ObaVM* vm, Obj* obj) { pushGray(&vm->gray, obj); }
+
 void initTable(Table* table) {
   table->count = 0;
+  table->used = 0;
   table->capacity = 0;
+  table->control = NULL;
   table->entries = NULL;
 }
 
 // Frees the memory held by all table entries. This does not free the table
 // pointer itself.
 void freeTable(ObaVM* vm, Table* table) {
+  FREE_ARRAY(vm, uint8_t, table->control, table->capacity);
   FREE_ARRAY(vm, Entry, table->entries, table->capacity);
   initTable(table);
 }
 
-Entry* findEntry(Entry* entries, int capacity, ObjString* key) {
-  uint32_t index = key->hash % capacity;
-  Entry* tombstone = NULL;
+// Returns a bitmask with bit i set for each control byte in the group starting
+// at [control] that is equal to [byte].
+static uint32_t matchGroup(const uint8_t* control, uint8_t byte) {
+#ifdef __SSE2__
+  __m128i group = _mm_loadu_si128((const __m128i*)control);
+  return (uint32_t)_mm_movemask_epi8(
+      _mm_cmpeq_epi8(group, _mm_set1_epi8((char)byte)));
+#else
+  uint32_t mask = 0;
+  for (int i = 0; i < TABLE_GROUP_SIZE; i++) {
+    if (control[i] == byte) mask |= 1u << i;
+  }
+  return mask;
+#endif
+}
 
-  for (;;) {
-    Entry* entry = &entries[index];
+// Returns a bitmask with bit i set for each entry in the group starting at
+// [control] that has no key.
+static uint32_t matchFree(const uint8_t* control) {
+#ifdef __SSE2__
+  // Only the empty and deleted control bytes have their sign bit set.
+  __m128i group = _mm_loadu_si128((const __m128i*)control);
+  return (uint32_t)_mm_movemask_epi8(group);
+#else
+  uint32_t mask = 0;
+  for (int i = 0; i < TABLE_GROUP_SIZE; i++) {
+    if (control[i] & 0x80) mask |= 1u << i;
+  }
+  return mask;
+#endif
+}
 
-    if (entry->key == NULL) {
-      if (IS_NIL(entry->value)) {
-        // tombstone.
-        return tombstone != NULL ? tombstone : entry;
-      } else {
-        if (tombstone == NULL) tombstone = entry;
-      }
-    } else if (entry->key->hash == key->hash) {
-      return entry;
+// The control byte of an entry whose key has [hash].
+static uint8_t hashControl(uint32_t hash) { return hash & 0x7f; }
+
+// The group where the search for a key with [hash] starts.
+static int hashGroup(Table* table, uint32_t hash) {
+  return (int)(hash >> 7) & (table->capacity / TABLE_GROUP_SIZE - 1);
+}
+
+// Returns the next group to search after the [probe]th group, [group]. The
+// groups visited are the start group plus 1, 3, 6, 10..., which covers every
+// group when the number of groups is a power of two.
+static int nextGroup(Table* table, int group, int probe) {
+  return (group + probe + 1) & (table->capacity / TABLE_GROUP_SIZE - 1);
+}
+
+static bool keysEqual(ObjString* a, ObjString* b, uint32_t hash) {
+  return a == b || (a->hash == hash && a->length == b->length &&
+                    memcmp(a->chars, b->chars, a->length) == 0);
+}
+
+// Returns the index of the entry whose key is equal to [key], or -1 if there
+// is none.
+static int findEntry(Table* table, ObjString* key) {
+  if (table->count == 0) return -1;
+
+  uint32_t hash = stringHash(key);
+  uint8_t control = hashControl(hash);
+  int group = hashGroup(table, hash);
+
+  for (int probe = 0;; probe++) {
+    int start = group * TABLE_GROUP_SIZE;
+    uint32_t matches = matchGroup(&table->control[start], control);
+    while (matches != 0) {
+      int index = start + __builtin_ctz(matches);
+      if (keysEqual(table->entries[index].key, key, hash)) return index;
+      matches &= matches - 1;
     }
 
-    index = (index + 1) % capacity;
+    // A group with an empty entry ends the search, since the key would have
+    // been stored there.
+    if (matchGroup(&table->control[start], TABLE_EMPTY) != 0) return -1;
+    group = nextGroup(table, group, probe);
   }
 }
 
-void adjustCapacity(ObaVM* vm, Table* table, int capacity) {
-  Entry* entries = ALLOCATE(vm, Entry, capacity + 1);
+// Returns the index of the first entry without a key on the search path for
+// [hash], where a new key with that hash belongs.
+static int findFreeEntry(Table* table, uint32_t hash) {
+  int group = hashGroup(table, hash);
+  for (int probe = 0;; probe++) {
+    int start = group * TABLE_GROUP_SIZE;
+    uint32_t free = matchFree(&table->control[start]);
+    if (free != 0) return start + __builtin_ctz(free);
+    group = nextGroup(table, group, probe);
+  }
+}
+
+static void adjustCapacity(ObaVM* vm, Table* table, int capacity) {
+  uint8_t* control = ALLOCATE(vm, uint8_t, capacity);
+  Entry* entries = ALLOCATE(vm, Entry, capacity);
+  memset(control, TABLE_EMPTY, capacity);
   for (int i = 0; i < capacity; i++) {
     entries[i].key = NULL;
     entries[i].value = NIL_VAL;
   }
 
+  Table old = *table;
+  table->control = control;
+  table->entries = entries;
+  table->capacity = capacity;
   table->count = 0;
-  for (int i = 0; i < table->capacity; i++) {
-    Entry* entry = &table->entries[i];
+  table->used = 0;
+
+  // Deleted entries are dropped.
+  for (int i = 0; i < old.capacity; i++) {
+    Entry* entry = &old.entries[i];
     if (entry->key == NULL) continue;
 
-    Entry* dest = findEntry(entries, capacity, entry->key);
-    dest->key = entry->key;
-    dest->value = entry->value;
+    int index = findFreeEntry(table, entry->key->hash);
+    table->control[index] = hashControl(entry->key->hash);
+    table->entries[index] = *entry;
     table->count++;
+    table->used++;
   }
 
-  FREE_ARRAY(vm, Entry, table->entries, table->capacity + 1);
-  table->entries = entries;
-  table->capacity = capacity;
+  FREE_ARRAY(vm, uint8_t, old.control, old.capacity);
+  FREE_ARRAY(vm, Entry, old.entries, old.capacity);
 }
 
 static ObjString* tableFindString(Table* table, const char* chars, int length,
                                   uint32_t hash) {
   if (table->count == 0) return NULL;
 
-  uint32_t index = hash % table->capacity;
-
-  for (;;) {
-    Entry* entry = &table->entries[index];
-    if (entry->key == NULL) {
-      if (IS_NIL(entry->value)) return NULL;
-    } else if (entry->key->length == length && entry->key->hash == hash &&
-               memcmp(entry->key->chars, chars, length) == 0) {
-      return entry->key;
+  uint8_t control = hashControl(hash);
+  int group = hashGroup(table, hash);
+
+  for (int probe = 0;; probe++) {
+    int start = group * TABLE_GROUP_SIZE;
+    uint32_t matches = matchGroup(&table->control[start], control);
+    while (matches != 0) {
+      ObjString* key = table->entries[start + __builtin_ctz(matches)].key;
+      if (key->hash == hash && key->length == length &&
+          memcmp(key->chars, chars, length) == 0) {
+        return key;
+      }
+      matches &= matches - 1;
     }
-    index = (index + 1) % table->capacity;
+
+    if (matchGroup(&table->control[start], TABLE_EMPTY) != 0) return NULL;
+    group = nextGroup(table, group, probe);
   }
 }
 
 bool tableGet(Table* table, ObjString* key, Value* value) {
-  if (table->count == 0) return false;
-
-  Entry* entry = findEntry(table->entries, table->capacity, key);
-  if (entry->key == NULL) return false;
+  int index = findEntry(table, key);
+  if (index < 0) return false;
 
-  *value = entry->value;
+  *value = table->entries[index].value;
   return true;
 }
 
 bool tableSet(ObaVM* vm, Table* table, ObjString* key, Value value) {
-  if (table->count >= table->capacity * TABLE_MAX_LOAD) {
-    int capacity = GROW_CAPACITY(table->capacity);
-    adjustCapacity(vm, table, capacity);
+  int index = findEntry(table, key);
+  if (index >= 0) {
+    table->entries[index].value = value;
+    return false;
   }
 
-  Entry* entry = findEntry(table->entries, table->capacity, key);
-
-  bool isNewKey = entry->key == NULL;
-  if (isNewKey && IS_NIL(entry->value)) table->count++;
+  if (table->used + 1 > table->capacity * TABLE_MAX_LOAD) {
+    // Deleted entries count towards the load, so a table that is mostly
+    // deleted entries, like the string table after a collection, is rebuilt
+    // at the same size instead of growing.
+    int capacity = table->capacity;
+    if (capacity == 0) {
+      capacity = TABLE_GROUP_SIZE;
+    } else if (table->count + 1 > capacity * TABLE_MAX_LOAD / 2) {
+      capacity *= 2;
+    }
+    adjustCapacity(vm, table, capacity);
+  }
 
-  entry->key = key;
-  entry->value = value;
-  return isNewKey;
+  uint32_t hash = stringHash(key);
+  index = findFreeEntry(table, hash);
+  if (table->control[index] == TABLE_EMPTY) table->used++;
+  table->count++;
+  table->control[index] = hashControl(hash);
+  table->entries[index].key = key;
+  table->entries[index].value = value;
+  return true;
 }
 
-bool tableDelete(ObaVM* vm, Table* table, ObjString* key) {
-  if (table->count == 0) return false;
-
-  Entry* entry = findEntry(table->entries, table->capacity, key);
-  if (entry->key == NULL) return false;
+// Removes the entry at [index] of [table].
+static void deleteEntry(Table* table, int index) {
+  // A search only continues past a group without empty entries. If this
+  // entry's group has one, no search can depend on this entry being full, so
+  // it can be emptied instead of marked deleted.
+  int start = index - index % TABLE_GROUP_SIZE;
+  if (matchGroup(&table->control[start], TABLE_EMPTY) != 0) {
+    table->control[index] = TABLE_EMPTY;
+    table->used--;
+  } else {
+    table->control[index] = TABLE_DELETED;
+  }
+  table->entries[index].key = NULL;
+  table->entries[index].value = NIL_VAL;
+  table->count--;
+}
 
-  entry->key = NULL;
-  entry->value = OBA_BOOL(true);
+bool tableDelete(Table* table, ObjString* key) {
+  int index = findEntry(table, key);
+  if (index < 0) return false;
 
+  deleteEntry(table, index);
   return true;
 }
+
+void tableRemoveWhite(ObaVM* vm, Table* table) {
+  for (int i = 0; i < table->capacity; i++) {
+    Entry* entry = &table->entries[i];
+    if (entry->key != NULL && !IS_MARKED(vm, &entry->key->obj)) {
+      deleteEntry(table, i);
+    }
+  }
+}
@@ -9,6 +9,57 @@
 
 // Helper macros for coverting to and from Oba values -------------------------
 
+#ifdef OBA_NAN_TAGGING
+
+// NaN-tagged values.
+//
+// A double is 64 bits. When all of its 11 exponent bits are set it is NaN, and
+// when the highest mantissa bit is also set it is a "quiet" NaN. The CPU only
+// ever produces a single quiet NaN bit pattern, which leaves the remaining 51
+// bits free to encode other values:
+//
+//  - Numbers are stored as plain doubles.
+//  - Singletons (nil, true and false) are quiet NaNs with a small tag in the
+//    lowest bits.
+//  - Objects are quiet NaNs with the sign bit set. The pointer lives in the
+//    low 48 bits, which is all that x86-64 and ARM64 use for addresses.
+//
+// Bit 50 is set in QNAN as well, so that the real NaN produced by arithmetic
+// such as 0/0 is never mistaken for a tagged value.
+#define SIGN_BIT ((uint64_t)0x8000000000000000)
+#define QNAN ((uint64_t)0x7ffc000000000000)
+
+#define TAG_NIL 1
+#define TAG_FALSE 2
+#define TAG_TRUE 3
+#define TAG_UNDEFINED 4
+
+#define FALSE_VAL ((Value)(uint64_t)(QNAN | TAG_FALSE))
+#define TRUE_VAL ((Value)(uint64_t)(QNAN | TAG_TRUE))
+
+// Macros for converting from C to Oba.
+#define OBA_BOOL(value) ((value) ? TRUE_VAL : FALSE_VAL)
+#define OBA_NUMBER(value) numberToValue(value)
+#define OBJ_VAL(object)                                                        \
+  ((Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(object)))
+
+// Macros for type-checking.
+#define IS_BOOL(value) (((value) | 1) == TRUE_VAL)
+#define IS_NUMBER(value) (((value)&QNAN) != QNAN)
+#define IS_OBJ(value) (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+#define IS_NIL(value) ((value) == NIL_VAL)
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
+
+// Macros for converting from Oba to C.
+#define AS_BOOL(value) ((value) == TRUE_VAL)
+#define AS_NUMBER(value) valueToNumber(value)
+#define AS_OBJ(value) ((Obj*)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
+
+#define NIL_VAL ((Value)(uint64_t)(QNAN | TAG_NIL))
+#define UNDEFINED_VAL ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
+
+#else
+
 // Macros for converting from C to Oba.
 #define OBA_BOOL(value) ((Value){VAL_BOOL, {.boolean = value}})
 #define OBA_NUMBER(value) ((Value){VAL_NUMBER, {.number = value}})
@@ -19,6 +70,19 @@
 #define IS_NUMBER(value) ((value).type == VAL_NUMBER)
 #define IS_OBJ(value) ((value).type == VAL_OBJ)
 #define IS_NIL(value) ((value).type == VAL_NIL)
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
+
+// Macros for converting from Oba to C.
+#define AS_BOOL(value) ((value).as.boolean)
+#define AS_NUMBER(value) ((value).as.number)
+#define AS_OBJ(value) ((value).as.obj)
+
+#define NIL_VAL ((Value){VAL_NIL, {0}})
+#define UNDEFINED_VAL ((Value){VAL_UNDEFINED, {0}})
+
+#endif
+
+// Macros for type-checking objects.
 #define IS_STRING(value) isObjType(value, OBJ_STRING)
 #define IS_FUNCTION(value) isObjType(value, OBJ_FUNCTION)
 #define IS_CLOSURE(value) isObjType(value, OBJ_CLOSURE)
@@ -29,10 +93,7 @@
 #define IS_INSTANCE(value) isObjType(value, OBJ_INSTANCE)
 #define OBJ_TYPE(value) (AS_OBJ(value)->type)
 
-// Macros for converting from Oba to C.
-#define AS_BOOL(value) ((value).as.boolean)
-#define AS_NUMBER(value) ((value).as.number)
-#define AS_OBJ(value) ((value).as.obj)
+// Macros for converting from Oba objects to C.
 #define AS_FUNCTION(value) ((ObjFunction*)AS_OBJ(value))
 #define AS_CLOSURE(value) ((ObjClosure*)AS_OBJ(value))
 #define AS_STRING(value) ((ObjString*)AS_OBJ(value))
@@ -43,13 +104,20 @@
 #define AS_CTOR(value) ((ObjCtor*)AS_OBJ(value))
 #define AS_INSTANCE(value) ((ObjInstance*)AS_OBJ(value))
 
-#define NIL_VAL ((Value){VAL_NIL, {0}})
-
 #define TABLE_MAX_LOAD 0.75
 
-// Maximum number of printable characters to use when formatting a Value.
-// TODO(kendal): Switch to using a growable buffer when formatting values.
-#define FORMAT_VALUE_MAX 10000
+// Table entries are searched in groups of this many, using one control byte per
+// entry to rule out most keys without touching the entry itself.
+#define TABLE_GROUP_SIZE 16
+
+// The control bytes of entries without a key. A full entry's control byte holds
+// the low 7 bits of its key's hash, so only these have the high bit set.
+#define TABLE_EMPTY 0x80
+#define TABLE_DELETED 0xfe
+
+// Concatenations shorter than this are copied into a flat string instead of
+// creating a rope.
+#define ROPE_MIN_LENGTH 64
 
 // An Oba object in heap memory.
 typedef enum {
@@ -66,17 +134,64 @@ typedef enum {
 typedef struct Obj {
   ObjType type;
   struct Obj* next;
-  bool isMarked;
+
+  // The object is marked when this equals the VM's [markColor]. Objects that
+  // survive a collection stay marked until the next full collection flips the
+  // color, so outside of marking only old objects are marked.
+  bool mark;
+
+  // Whether the object is in the VM's remembered set, or, while a full
+  // collection is marking, whether a barrier has pushed it onto the gray stack
+  // since it was last blackened.
+  bool isRemembered;
 } Obj;
 
-// A tagged-union representing Oba values.
+// The types of Oba values.
 typedef enum {
   VAL_NIL,
   VAL_BOOL,
   VAL_NUMBER,
   VAL_OBJ,
+
+  // The value of a module variable that has been declared but not yet defined.
+  // This is internal to the VM and is never visible to Oba code.
+  VAL_UNDEFINED,
 } ValueType;
 
+#ifdef OBA_NAN_TAGGING
+
+// A NaN-tagged Oba value. See the comment at the top of this file.
+typedef uint64_t Value;
+
+// Used to reinterpret the bits of a double as a Value and vice versa.
+typedef union {
+  uint64_t bits;
+  double number;
+} DoubleBits;
+
+static inline double valueToNumber(Value value) {
+  DoubleBits data;
+  data.bits = value;
+  return data.number;
+}
+
+static inline Value numberToValue(double number) {
+  DoubleBits data;
+  data.number = number;
+  return data.bits;
+}
+
+static inline ValueType valueType(Value value) {
+  if (IS_NUMBER(value)) return VAL_NUMBER;
+  if (IS_OBJ(value)) return VAL_OBJ;
+  if (IS_NIL(value)) return VAL_NIL;
+  if (IS_UNDEFINED(value)) return VAL_UNDEFINED;
+  return VAL_BOOL;
+}
+
+#else
+
+// A tagged-union representing Oba values.
 typedef struct {
   ValueType type;
   union {
@@ -86,11 +201,29 @@ typedef struct {
   } as;
 } Value;
 
-typedef struct {
+static inline ValueType valueType(Value value) { return value.type; }
+
+#endif
+
+typedef struct ObjString {
   Obj obj;
   int length;
+
+  // The string's characters, or NULL if the string is a rope that has not been
+  // flattened yet.
   char* chars;
+
+  // The hash of [chars] if [hasHash] is set. Interned strings are hashed when
+  // they are created, and other strings the first time they need a hash.
   uint32_t hash;
+  bool hasHash;
+
+  // The strings this rope is the concatenation of. A rope is created by
+  // concatenation instead of copying both operands, and is only flattened
+  // into [chars] when its characters are needed. Both are NULL for a flat
+  // string, including a rope that has been flattened.
+  struct ObjString* left;
+  struct ObjString* right;
 } ObjString;
 
 typedef Value (*NativeFn)(ObaVM* vm, int argc, Value* argv);
@@ -105,36 +238,6 @@ typedef struct {
   NativeFn function;
 } ObjNative;
 
-typedef struct {
-  ObjString* key;
-  Value value;
-} Entry;
-
-typedef struct {
-  int count;
-  int capacity;
-  Entry* entries;
-} Table;
-
-typedef struct {
-  Obj obj;
-  Table* variables;
-  ObjString* name;
-} ObjModule;
-
-typedef struct {
-  Obj obj;
-  ObjString* family;
-  ObjString* name;
-  int arity;
-} ObjCtor;
-
-typedef struct {
-  Obj obj;
-  ObjCtor* ctor;
-  Value* fields;
-} ObjInstance;
-
 #define DECLARE_BUFFER(kind, type)                                             \
   typedef struct {                                                             \
     int capacity;                                                              \
@@ -172,44 +275,187 @@ DECLARE_BUFFER(Byte, uint8_t);
 DECLARE_BUFFER(Value, Value);
 DECLARE_BUFFER(String, ObjString*);
 
+typedef struct {
+  ObjString* key;
+  Value value;
+} Entry;
+
+typedef struct {
+  // The number of entries with keys.
+  int count;
+
+  // The number of entries that are not empty, counting deleted entries.
+  int used;
+
+  // Either zero or a power of two that is at least TABLE_GROUP_SIZE.
+  int capacity;
+
+  // The control byte of each entry.
+  uint8_t* control;
+  Entry* entries;
+} Table;
+
+typedef struct {
+  Obj obj;
+
+  // The values of the module's top-level variables, indexed by slot.
+  ValueBuffer variables;
+
+  // The names of the module's top-level variables, indexed by slot.
+  StringBuffer variableNames;
+
+  // Maps the name of each top-level variable to its slot.
+  Table variableSlots;
+
+  ObjString* name;
+} ObjModule;
+
+typedef struct {
+  Obj obj;
+  ObjString* family;
+  ObjString* name;
+  int arity;
+
+  // The position of this constructor in its family's declaration, starting at
+  // zero.
+  int tag;
+
+  // The only instance of this constructor if it has no fields, or NULL if it
+  // has fields or has not been called yet. Every call returns this instance,
+  // so instances of the constructor are equal iff they are the same object.
+  struct ObjInstance* instance;
+} ObjCtor;
+
+typedef struct ObjInstance {
+  Obj obj;
+  ObjCtor* ctor;
+
+  // The instance's fields, one for each of its constructor's parameters.
+  Value fields[];
+} ObjInstance;
+
+
 static inline bool isObjType(Value value, ObjType type) {
   return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
 
 bool valuesEqual(Value a, Value b);
+
+// Appends the text of [value] to [buffer], growing it as needed.
+//
+// The buffer's memory is not tracked by the GC, so writing never triggers a
+// collection and [value] does not need to be reachable. Release the buffer with
+// [freeFormatBuffer].
+void writeValue(ByteBuffer* buffer, Value value);
+void writeBytes(ByteBuffer* buffer, const char* bytes, int count);
+void freeFormatBuffer(ByteBuffer* buffer);
+
+// Returns the text of [value] as a string.
 ObjString* formatValue(ObaVM* vm, Value value);
 void printValue(Value value);
 bool canAssignType(Value, Value);
 const char* valueTypeName(Value);
 
+// Objects that have been marked but whose references have not been traced yet.
+typedef struct {
+  ObaVM* vm;
+  int count;
+  int capacity;
+  Obj** objects;
+
+  // Whether other markers are marking objects at the same time as this one, so
+  // marks must be set atomically.
+  bool isShared;
+} GrayStack;
+
+void initGrayStack(GrayStack*, ObaVM*);
+void freeGrayStack(GrayStack*);
+
+// Pushes [obj], which must already be marked, onto [gray].
+void pushGray(GrayStack* gray, Obj* obj);
+
+// Marks [obj] and pushes it onto [gray], unless it is already marked.
+void grayObject(GrayStack* gray, Obj* obj);
+void grayValue(GrayStack* gray, Value value);
+
+// Grays the objects that [obj] refers to.
+void blackenObject(GrayStack* gray, Obj* obj);
+
+// Gray objects onto the VM's gray stack.
 void obaGrayTable(ObaVM*, Table*);
 void obaGrayValue(ObaVM*, Value);
-void obaGrayValueBuffer(ObaVM*, ValueBuffer*);
-void obaGrayStringBuffer(ObaVM*, StringBuffer*);
 void obaGrayObject(ObaVM*, Obj*);
-void blackenObject(ObaVM*, Obj*);
+
+// Pushes [obj], which must already be marked, onto the VM's gray stack.
+void obaPushGray(ObaVM*, Obj*);
 
 bool objectsEqual(Value, Value);
 Obj* allocateObject(ObaVM* vm, size_t size, ObjType type);
 void freeObject(ObaVM*, Obj*);
 
+// Returns the interned string with the given characters, creating it if
+// necessary. Interning is for strings that are likely to be compared or looked
+// up again, like identifiers and constants. [takeString] takes ownership of
+// [chars], which were allocated with room for a terminator.
 ObjString* copyString(ObaVM* vm, const char* chars, int length);
 ObjString* allocateString(ObaVM* vm, char* chars, int length, uint32_t hash);
 ObjString* takeString(ObaVM* vm, char* chars, int length);
+
+// Returns a new string with the given characters without hashing or interning
+// it. This is for strings computed at runtime, like input and formatted
+// values, which are usually used once. [takeTransientString] takes ownership
+// of [chars], which were allocated with room for a terminator.
+ObjString* copyTransientString(ObaVM* vm, const char* chars, int length);
+ObjString* takeTransientString(ObaVM* vm, char* chars, int length);
+
+// Returns the hash of [string], which must be flat, computing it the first time
+// it is needed.
+uint32_t stringHash(ObjString* string);
 ObjString* trimString(ObaVM*, ObjString*);
 
+// Returns a string that is the concatenation of [left] and [right]. Short
+// results are copied into a new string. Longer results are ropes which share
+// the characters of their operands.
+ObjString* concatenateStrings(ObaVM* vm, ObjString* left, ObjString* right);
+
+// Copies the characters of [string] into [chars], which has room for at least
+// string->length characters. Unlike [flattenString], this never allocates.
+void copyStringChars(ObjString* string, char* chars);
+
+// Stores the characters of [string] in the string itself if it is a rope, and
+// returns it. This can trigger a collection, so [string] must be reachable.
+ObjString* flattenString(ObaVM* vm, ObjString* string);
+
 ObjNative* newNative(ObaVM*, NativeFn);
 
 ObjModule* newModule(ObaVM* vm, ObjString* name);
 
-ObjCtor* newCtor(ObaVM* vm, ObjString* family, ObjString* name, int arity);
+// Returns the slot of the top-level variable [name] in [module], or -1 if there
+// is no such variable.
+int findModuleVariable(ObjModule* module, ObjString* name);
+
+// Declares a top-level variable [name] in [module] if it does not already
+// exist. New variables are undefined until they are assigned a value.
+// Returns the variable's slot.
+int declareModuleVariable(ObaVM* vm, ObjModule* module, ObjString* name);
+
+// Sets the top-level variable [name] in [module] to [value], declaring it if
+// necessary. Returns the variable's slot.
+int defineModuleVariable(ObaVM* vm, ObjModule* module, ObjString* name,
+                         Value value);
+
+ObjCtor* newCtor(ObaVM* vm, ObjString* family, ObjString* name, int arity,
+                 int tag);
 ObjInstance* newInstance(ObaVM* vm, ObjCtor* ctor);
 
 void initTable(Table* table);
 void freeTable(ObaVM* vm, Table* table);
-Entry* findEntry(Entry* entries, int capacity, ObjString* key);
-void adjustCapacity(ObaVM* vm, Table* table, int capacity);
 bool tableGet(Table* table, ObjString* key, Value* value);
 bool tableSet(ObaVM* vm, Table* table, ObjString* key, Value value);
+bool tableDelete(Table* table, ObjString* key);
+
+// Deletes the entries of [table] whose keys were not marked by the current
+// collection.
+void tableRemoveWhite(ObaVM* vm, Table* table);
 
 #endif
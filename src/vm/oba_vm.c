@@ -1,14 +1,18 @@
+#include <errno.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "oba.h"
 #include "oba_builtins.h"
 #include "oba_common.h"
 #include "oba_compiler.h"
 #include "oba_function.h"
+#include "oba_jit.h"
 #include "oba_vm.h"
 
 #ifdef DEBUG_TRACE_EXECUTION
@@ -65,6 +69,26 @@ static void ensureStack(ObaVM* vm, int needed) {
   }
 }
 
+static void ensureFrames(ObaVM* vm, int needed) {
+  if (vm->frameCapacity >= needed) return;
+
+  int oldCapacity = vm->frameCapacity;
+  while (vm->frameCapacity < needed) {
+    vm->frameCapacity = GROW_CAPACITY(vm->frameCapacity);
+  }
+  if (vm->frameCapacity > vm->maxFrames && needed <= vm->maxFrames) {
+    vm->frameCapacity = vm->maxFrames;
+  }
+
+  int frameCount = oldCapacity == 0 ? 0 : (int)(vm->frame - vm->frames);
+  vm->frames = GROW_ARRAY(vm, CallFrame, vm->frames, oldCapacity,
+                          vm->frameCapacity);
+
+  // If the reallocation moved the frames, the current frame must point into
+  // the new array. Nothing else holds a pointer to a frame.
+  vm->frame = vm->frames + frameCount;
+}
+
 static void growStack(ObaVM* vm) {
   ensureStack(vm, GROW_CAPACITY(vm->stackCapacity));
 }
@@ -103,7 +127,8 @@ static void defineNative(ObaVM* vm, const char* name, NativeFn function) {
 }
 
 void runtimeError(ObaVM* vm) {
-  ObjString* message = formatValue(vm, vm->error);
+  obaFlushOutput(vm);
+  ObjString* message = flattenString(vm, formatValue(vm, vm->error));
   fprintf(stderr, "Runtime error: %s\n", message->chars);
 
 #ifndef DISABLE_STACK_TRACES
@@ -140,39 +165,43 @@ static void registerBuiltins(ObaVM* vm, Builtin* builtins, int builtinsLength) {
   }
 }
 
-static bool isTailCall(ObaVM* vm, ObjClosure* closure) {
-  CallFrame* frame = vm->frame;
-  return frame->ip != NULL && (uint8_t)(*frame->ip) == OP_RETURN &&
-         objectsEqual(OBJ_VAL(closure->function),
-                      OBJ_VAL(frame->closure->function));
-}
-
-static void reuseStackSlots(ObaVM* vm, int arity) {
-  Value* oldStackTop = vm->frame->slots + arity;
-  for (int i = 1; i <= arity; i++) {
-    *(oldStackTop - i) = *(vm->stackTop - i);
+// Counts a call or loop iteration of [function] towards the JIT threshold, and
+// compiles the function once it reaches the threshold.
+static void warmUp(ObaVM* vm, ObjFunction* function) {
+#ifdef OBA_JIT
+  if (!vm->jitEnabled || function->hotness >= OBA_JIT_THRESHOLD) return;
+  if (++function->hotness == OBA_JIT_THRESHOLD) {
+    obaJitCompile(vm, function);
   }
-  vm->stackTop = oldStackTop;
+#else
+  (void)vm;
+  (void)function;
+#endif
 }
+
 static bool call(ObaVM* vm, ObjClosure* closure, int arity) {
   if (arity != closure->function->arity) {
     obaArityError(vm, closure->function->arity, arity);
     return false;
   }
 
-  if (isTailCall(vm, closure)) {
-    reuseStackSlots(vm, arity);
-  } else {
-    vm->frame++;
-  }
-
-  if (vm->frame - vm->frames >= FRAMES_MAX) {
+  int depth = (int)(vm->frame - vm->frames) + 1;
+  if (depth >= vm->maxFrames) {
     obaErrorf(vm, "Too many nested function calls");
     return false;
   }
+  ensureFrames(vm, depth + 1);
+
+  // Make room for every value the function pushes, so its instructions never
+  // need to grow the stack.
+  int base = (int)(vm->stackTop - vm->stack) - arity;
+  ensureStack(vm, base + closure->function->maxSlots);
+  vm->frame++;
+
   vm->frame->closure = closure;
   vm->frame->ip = closure->function->chunk.code;
   vm->frame->slots = vm->stackTop - arity;
+  warmUp(vm, closure->function);
   return true;
 }
 
@@ -190,6 +219,16 @@ static bool callCtor(ObaVM* vm, ObjCtor* ctor, int arity) {
     return false;
   }
 
+  if (ctor->arity == 0) {
+    if (ctor->instance == NULL) {
+      ctor->instance = newInstance(vm, ctor);
+      WRITE_BARRIER(vm, ctor);
+    }
+    pop(vm); // ctor.
+    push(vm, OBJ_VAL(ctor->instance));
+    return true;
+  }
+
   ObjInstance* instance = newInstance(vm, ctor);
   for (int i = 0; i < ctor->arity; i++) {
     instance->fields[ctor->arity - i - 1] = pop(vm);
@@ -242,6 +281,127 @@ static void destructure(ObaVM* vm, Value pattern, Value value) {
   }
 }
 
+static bool isLiteral(Value value) {
+  return IS_NUMBER(value) || IS_STRING(value) || IS_BOOL(value);
+}
+
+static uint32_t hashLiteral(Value value) {
+  if (IS_STRING(value)) return stringHash(AS_STRING(value));
+  if (IS_BOOL(value)) return AS_BOOL(value) ? 1 : 0;
+
+  // Equal numbers with different bits, like 0 and -0, hash differently. Such
+  // a value misses the table and is matched by the sequential tests instead.
+  double number = AS_NUMBER(value);
+  uint64_t bits;
+  memcpy(&bits, &number, sizeof(bits));
+  return (uint32_t)(bits ^ (bits >> 32));
+}
+
+// Returns the entry for [literal] in [table]'s literals, which is either the
+// entry holding it or the empty entry where it belongs.
+static MatchEntry* findLiteral(MatchTable* table, Value literal) {
+  uint32_t mask = (uint32_t)table->literalCapacity - 1;
+  uint32_t index = hashLiteral(literal) & mask;
+  for (;;) {
+    MatchEntry* entry = &table->literals[index];
+    if (entry->arm < 0 || valuesEqual(entry->pattern, literal)) return entry;
+    index = (index + 1) & mask;
+  }
+}
+
+// Builds the dispatch tables for [table] from the patterns of its arms, which
+// are defined in [module].
+//
+// Returns false if some pattern's variable is not defined yet, in which case
+// the tables are built the next time the match runs.
+static bool buildMatchTable(ObaVM* vm, ObjModule* module, ObjFunction* function,
+                            MatchTable* table) {
+  int maxTag = -1;
+  int literalCount = 0;
+  for (int i = 0; i < table->arms.count; i++) {
+    MatchArm* arm = &table->arms.values[i];
+    Value pattern = arm->isVariable
+                        ? module->variables.values[arm->index]
+                        : function->chunk.constants.values[arm->index];
+    if (IS_UNDEFINED(pattern)) return false;
+
+    if (IS_CTOR(pattern)) {
+      if (AS_CTOR(pattern)->tag > maxTag) maxTag = AS_CTOR(pattern)->tag;
+    } else if (isLiteral(pattern)) {
+      // Literals are found by their hash, which needs a flat string.
+      if (IS_STRING(pattern)) flattenString(vm, AS_STRING(pattern));
+      literalCount++;
+    } else {
+      // The pattern could be equal to an instance, so instances can't be
+      // dispatched on their tags alone.
+      table->state = MATCH_SEQUENTIAL;
+      return true;
+    }
+  }
+
+  table->tagCount = maxTag + 1;
+  table->tags = ALLOCATE(vm, MatchEntry, table->tagCount);
+  for (int i = 0; i < table->tagCount; i++) {
+    table->tags[i].pattern = NIL_VAL;
+    table->tags[i].arm = -1;
+  }
+
+  if (literalCount > 0) {
+    table->literalCapacity = 4;
+    while (table->literalCapacity < literalCount * 2) {
+      table->literalCapacity *= 2;
+    }
+    table->literals = ALLOCATE(vm, MatchEntry, table->literalCapacity);
+    for (int i = 0; i < table->literalCapacity; i++) {
+      table->literals[i].pattern = NIL_VAL;
+      table->literals[i].arm = -1;
+    }
+  }
+
+  // Earlier arms take precedence over later arms with the same pattern.
+  for (int i = 0; i < table->arms.count; i++) {
+    MatchArm* arm = &table->arms.values[i];
+    Value pattern = arm->isVariable
+                        ? module->variables.values[arm->index]
+                        : function->chunk.constants.values[arm->index];
+    MatchEntry* entry = IS_CTOR(pattern)
+                            ? &table->tags[AS_CTOR(pattern)->tag]
+                            : findLiteral(table, pattern);
+    if (entry->arm < 0) {
+      entry->pattern = pattern;
+      entry->arm = i;
+    }
+  }
+
+  table->state = MATCH_BUILT;
+  return true;
+}
+
+// Returns the arm of [table] whose pattern [value] matches, or NULL if the
+// arms must be tested in order to find out.
+static MatchArm* selectArm(ObaVM* vm, MatchTable* table, Value value) {
+  if (table->state == MATCH_UNBUILT) {
+    ObjFunction* function = vm->frame->closure->function;
+    if (!buildMatchTable(vm, function->module, function, table)) return NULL;
+  }
+  if (table->state != MATCH_BUILT) return NULL;
+
+  MatchEntry* entry = NULL;
+  if (IS_INSTANCE(value)) {
+    ObjCtor* ctor = AS_INSTANCE(value)->ctor;
+    if (ctor->tag >= table->tagCount) return NULL;
+    entry = &table->tags[ctor->tag];
+    // Constructors of another family may have the same tag.
+    if (entry->arm < 0 || AS_CTOR(entry->pattern) != ctor) return NULL;
+  } else if (table->literalCapacity > 0 && isLiteral(value)) {
+    entry = findLiteral(table, value);
+    if (entry->arm < 0) return NULL;
+  } else {
+    return NULL;
+  }
+  return &table->arms.values[entry->arm];
+}
+
 // Captures the local value in an upvalue.
 // If an existing upvalue already closes over the local, it is returned.
 // Otherwise a new one is created.
@@ -274,6 +434,7 @@ static void closeUpvalue(ObaVM* vm, Value* last) {
   while (vm->openUpvalues != NULL && vm->openUpvalues->location >= last) {
     vm->openUpvalues->closed = *vm->openUpvalues->location;
     vm->openUpvalues->location = &vm->openUpvalues->closed;
+    WRITE_BARRIER(vm, vm->openUpvalues);
     vm->openUpvalues = vm->openUpvalues->next;
   }
 }
@@ -296,8 +457,8 @@ ObjClosure* compileInModule(ObaVM* vm, Value value, const char* source) {
   obaPushRoot(vm, (Obj*)function);
 
   // Store the module as a global variable of the current module.
-  tableSet(vm, vm->frame->closure->function->module->variables, module->name,
-           OBJ_VAL(module));
+  defineModuleVariable(vm, vm->frame->closure->function->module, module->name,
+                       OBJ_VAL(module));
 
   ObjClosure* closure = newClosure(vm, function);
 
@@ -347,25 +508,100 @@ static void return_(ObaVM* vm) {
   vm->frame--;
 }
 
+// Evaluates the comparison instruction [comparison] on [a] and [b], storing
+// the outcome in [result]. Returns false and sets the VM's error if the
+// operands cannot be compared.
+static bool compareValues(ObaVM* vm, uint8_t comparison, Value a, Value b,
+                          bool* result) {
+  if (comparison == OP_EQ) {
+    *result = valuesEqual(a, b);
+    return true;
+  }
+  if (comparison == OP_NEQ) {
+    *result = !valuesEqual(a, b);
+    return true;
+  }
+  if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+    obaErrorf(vm, "Expected numeric or string operands");
+    return false;
+  }
+
+  switch (comparison) {
+  case OP_GT:
+    *result = AS_NUMBER(a) > AS_NUMBER(b);
+    break;
+  case OP_LT:
+    *result = AS_NUMBER(a) < AS_NUMBER(b);
+    break;
+  case OP_GTE:
+    *result = AS_NUMBER(a) >= AS_NUMBER(b);
+    break;
+  default:
+    *result = AS_NUMBER(a) <= AS_NUMBER(b);
+    break;
+  }
+  return true;
+}
+
 static void concatenate(ObaVM* vm) {
   ObjString* b = AS_STRING(peek(vm, 1));
   ObjString* a = AS_STRING(peek(vm, 2));
 
-  char* chars = ALLOCATE(vm, char, b->length + a->length + 1);
-  int length = b->length + a->length;
-
-  memcpy(chars, a->chars, a->length);
-  memcpy(chars + a->length, b->chars, b->length);
-  chars[length] = '\0';
-
-  ObjString* result = takeString(vm, chars, length);
+  ObjString* result = concatenateStrings(vm, a, b);
   pop(vm);
   pop(vm);
   push(vm, OBJ_VAL(result));
 }
 
-static void freeObjects(ObaVM* vm) {
-  Obj* obj = vm->objects;
+// Joins the [count] values starting at [parts] on the stack into a single
+// string, formatting the ones that are not strings.
+static ObjString* buildString(ObaVM* vm, Value* parts, int count) {
+  ByteBuffer buffer;
+  initByteBuffer(&buffer);
+  for (int i = 0; i < count; i++) {
+    writeValue(&buffer, parts[i]);
+  }
+
+  ObjString* string =
+      copyTransientString(vm, (char*)buffer.values, buffer.count);
+  freeFormatBuffer(&buffer);
+  return string;
+}
+
+// Calls the value below the top [arity] values on the stack in place of the
+// current frame, as if the current function returned the result of the call.
+static bool tailCall(ObaVM* vm, int arity) {
+  Value callee = peek(vm, arity + 1);
+  if (!IS_CLOSURE(callee)) {
+    // Natives and constructors don't have a frame of their own.
+    if (!callValue(vm, callee, arity)) return false;
+    return_(vm);
+    return true;
+  }
+
+  ObjClosure* closure = AS_CLOSURE(callee);
+  if (arity != closure->function->arity) {
+    obaArityError(vm, closure->function->arity, arity);
+    return false;
+  }
+
+  // Move the callee and its arguments to where the current function and its
+  // arguments are.
+  closeUpvalue(vm, vm->frame->slots);
+  Value* base = vm->frame->slots - 1;
+  memmove(base, vm->stackTop - arity - 1, sizeof(Value) * (arity + 1));
+  vm->stackTop = base + arity + 1;
+
+  vm->frame->closure = closure;
+  vm->frame->ip = closure->function->chunk.code;
+  vm->frame->slots = base + 1;
+  ensureStack(vm, (int)(vm->frame->slots - vm->stack) +
+                      closure->function->maxSlots);
+  warmUp(vm, closure->function);
+  return true;
+}
+
+static void freeObjectList(ObaVM* vm, Obj* obj) {
   while (obj != NULL) {
     Obj* next = obj->next;
     freeObject(vm, obj);
@@ -373,6 +609,11 @@ static void freeObjects(ObaVM* vm) {
   }
 }
 
+static void freeObjects(ObaVM* vm) {
+  freeObjectList(vm, vm->objects);
+  freeObjectList(vm, vm->oldObjects);
+}
+
 static ObaInterpretResult run(ObaVM* vm) {
 
 #define RUNTIME_ERROR()                                                        \
@@ -381,6 +622,15 @@ static ObaInterpretResult run(ObaVM* vm) {
     return OBA_RESULT_RUNTIME_ERROR;                                           \
   } while (0)
 
+// Pushes [value] without checking that the stack has room for it. Calling a
+// function makes room for the most values it can have on the stack.
+#define PUSH(value)                                                            \
+  do {                                                                         \
+    Value pushed = (value);                                                    \
+    ASSERT(vm->stackTop < vm->stack + vm->stackCapacity, "Stack overflow");    \
+    *vm->stackTop++ = pushed;                                                  \
+  } while (0)
+
 #define READ_BYTE() (*vm->frame->ip++)
 
 #define READ_SHORT()                                                           \
@@ -396,7 +646,62 @@ static ObaInterpretResult run(ObaVM* vm) {
     if (IS_NUMBER(peek(vm, 1)) && IS_NUMBER(peek(vm, 2))) {                    \
       double b = AS_NUMBER(pop(vm));                                           \
       double a = AS_NUMBER(pop(vm));                                           \
-      push(vm, type(a op b));                                                  \
+      PUSH(type(a op b));                                                      \
+    } else {                                                                   \
+      obaErrorf(vm, "Expected numeric or string operands");                    \
+      RUNTIME_ERROR();                                                         \
+    }                                                                          \
+  } while (0)
+
+// Rewrites the instruction being executed, which must be one byte long, into
+// [op]. Chunks are shared by all closures of a function, so every variant of
+// an instruction must accept any operands: a specialized instruction that sees
+// unexpected operands rewrites itself back into the generic one.
+#define QUICKEN(op) (vm->frame->ip[-1] = OP_##op)
+
+#define ADD_OP()                                                               \
+  do {                                                                         \
+    if (IS_STRING(peek(vm, 1)) && IS_STRING(peek(vm, 2))) {                    \
+      concatenate(vm);                                                         \
+    } else {                                                                   \
+      BINARY_OP(OBA_NUMBER, +);                                                \
+    }                                                                          \
+  } while (0)
+
+// Register-operand forms of the arithmetic instructions. The left operand is
+// always a local slot and the right operand is read by [readRight], which is
+// either another local slot or a constant.
+#define REGISTER_OP(readRight, op)                                             \
+  do {                                                                         \
+    Value a = vm->frame->slots[READ_BYTE()];                                   \
+    Value b = readRight;                                                       \
+    if (IS_NUMBER(a) && IS_NUMBER(b)) {                                        \
+      PUSH(OBA_NUMBER(AS_NUMBER(a) op AS_NUMBER(b)));                          \
+    } else {                                                                   \
+      obaErrorf(vm, "Expected numeric or string operands");                    \
+      RUNTIME_ERROR();                                                         \
+    }                                                                          \
+  } while (0)
+
+#define REGISTER_ADD_OP(readRight)                                             \
+  do {                                                                         \
+    Value a = vm->frame->slots[READ_BYTE()];                                   \
+    Value b = readRight;                                                       \
+    if (IS_NUMBER(a) && IS_NUMBER(b)) {                                        \
+      PUSH(OBA_NUMBER(AS_NUMBER(a) + AS_NUMBER(b)));                           \
+    } else {                                                                   \
+      PUSH(a);                                                                 \
+      PUSH(b);                                                                 \
+      ADD_OP();                                                                \
+    }                                                                          \
+  } while (0)
+
+#define REGISTER_MODULO_OP(readRight)                                          \
+  do {                                                                         \
+    Value a = vm->frame->slots[READ_BYTE()];                                   \
+    Value b = readRight;                                                       \
+    if (IS_NUMBER(a) && IS_NUMBER(b)) {                                        \
+      PUSH(OBA_NUMBER((double)((int)AS_NUMBER(a) % (int)AS_NUMBER(b))));       \
     } else {                                                                   \
       obaErrorf(vm, "Expected numeric or string operands");                    \
       RUNTIME_ERROR();                                                         \
@@ -427,6 +732,25 @@ static ObaInterpretResult run(ObaVM* vm) {
 
   // Optimizations
 
+#ifdef OBA_JIT
+
+// Switches to the current frame's machine code, if it has any. This runs after
+// the instructions that change frames or loop, since those are where execution
+// is most likely to enter a compiled function.
+#define JIT_ENTER()                                                            \
+  do {                                                                         \
+    ObjClosure* closure = vm->frame->closure;                                  \
+    if (vm->jitEnabled && closure != NULL && closure->function->jit != NULL) { \
+      obaJitRun(vm);                                                           \
+    }                                                                          \
+  } while (0)
+
+#else
+
+#define JIT_ENTER() ;
+
+#endif
+
 #ifdef OBA_COMPUTED_GOTO
 
 #define DISPATCH()                                                             \
@@ -441,7 +765,7 @@ static ObaInterpretResult run(ObaVM* vm) {
   // Computed goto dispatch table.
   // eli.thegreenplace.net/2012/07/12/computed-goto-for-efficient-dispatch-tables
   static void* dispatchTable[] = {
-#define OPCODE(name) &&op_##name,
+#define OPCODE(name, _) &&op_##name,
 #include "oba_opcodes.h"
 #undef OPCODE
   };
@@ -466,7 +790,7 @@ static ObaInterpretResult run(ObaVM* vm) {
   INTERPRET_LOOP {
 
     CASE_OP(CONSTANT) : {
-      push(vm, READ_CONSTANT());
+      PUSH(READ_CONSTANT());
       DISPATCH();
     }
 
@@ -476,11 +800,47 @@ static ObaInterpretResult run(ObaVM* vm) {
     }
 
     CASE_OP(ADD) : {
+      Value b = peek(vm, 1);
+      Value a = peek(vm, 2);
+      if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        QUICKEN(ADD_NUM);
+      } else if (IS_STRING(a) && IS_STRING(b)) {
+        QUICKEN(ADD_STR);
+      }
+      ADD_OP();
+      DISPATCH();
+    }
+
+    CASE_OP(ADD_NUM) : {
+      Value b = peek(vm, 1);
+      Value a = peek(vm, 2);
+      if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        vm->stackTop--;
+        vm->stackTop[-1] = OBA_NUMBER(AS_NUMBER(a) + AS_NUMBER(b));
+        DISPATCH();
+      }
+      QUICKEN(ADD);
+      ADD_OP();
+      DISPATCH();
+    }
+
+    CASE_OP(ADD_STR) : {
       if (IS_STRING(peek(vm, 1)) && IS_STRING(peek(vm, 2))) {
         concatenate(vm);
-      } else {
-        BINARY_OP(OBA_NUMBER, +);
+        DISPATCH();
       }
+      QUICKEN(ADD);
+      ADD_OP();
+      DISPATCH();
+    }
+
+    CASE_OP(ADD_LOCALS) : {
+      REGISTER_ADD_OP(vm->frame->slots[READ_BYTE()]);
+      DISPATCH();
+    }
+
+    CASE_OP(ADD_LOCAL_CONSTANT) : {
+      REGISTER_ADD_OP(READ_CONSTANT());
       DISPATCH();
     }
 
@@ -489,21 +849,51 @@ static ObaInterpretResult run(ObaVM* vm) {
       DISPATCH();
     }
 
+    CASE_OP(MINUS_LOCALS) : {
+      REGISTER_OP(vm->frame->slots[READ_BYTE()], -);
+      DISPATCH();
+    }
+
+    CASE_OP(MINUS_LOCAL_CONSTANT) : {
+      REGISTER_OP(READ_CONSTANT(), -);
+      DISPATCH();
+    }
+
     CASE_OP(MULTIPLY) : {
       BINARY_OP(OBA_NUMBER, *);
       DISPATCH();
     }
 
+    CASE_OP(MULTIPLY_LOCALS) : {
+      REGISTER_OP(vm->frame->slots[READ_BYTE()], *);
+      DISPATCH();
+    }
+
+    CASE_OP(MULTIPLY_LOCAL_CONSTANT) : {
+      REGISTER_OP(READ_CONSTANT(), *);
+      DISPATCH();
+    }
+
     CASE_OP(DIVIDE) : {
       BINARY_OP(OBA_NUMBER, /);
       DISPATCH();
     }
 
+    CASE_OP(DIVIDE_LOCALS) : {
+      REGISTER_OP(vm->frame->slots[READ_BYTE()], /);
+      DISPATCH();
+    }
+
+    CASE_OP(DIVIDE_LOCAL_CONSTANT) : {
+      REGISTER_OP(READ_CONSTANT(), /);
+      DISPATCH();
+    }
+
     CASE_OP(MODULO) : {
       if (IS_NUMBER(peek(vm, 1)) && IS_NUMBER(peek(vm, 2))) {
         int b = AS_NUMBER(pop(vm));
         int a = AS_NUMBER(pop(vm));
-        push(vm, OBA_NUMBER((double)(a % b)));
+        PUSH(OBA_NUMBER((double)(a % b)));
       } else {
         obaErrorf(vm, "Expected numeric or string operands");
         RUNTIME_ERROR();
@@ -512,12 +902,22 @@ static ObaInterpretResult run(ObaVM* vm) {
       DISPATCH();
     }
 
+    CASE_OP(MODULO_LOCALS) : {
+      REGISTER_MODULO_OP(vm->frame->slots[READ_BYTE()]);
+      DISPATCH();
+    }
+
+    CASE_OP(MODULO_LOCAL_CONSTANT) : {
+      REGISTER_MODULO_OP(READ_CONSTANT());
+      DISPATCH();
+    }
+
     CASE_OP(NOT) : {
       if (!IS_BOOL(peek(vm, 1))) {
         obaTypeError(vm, "boolean");
         RUNTIME_ERROR();
       }
-      push(vm, OBA_BOOL(!AS_BOOL(pop(vm))));
+      PUSH(OBA_BOOL(!AS_BOOL(pop(vm))));
       DISPATCH();
     }
 
@@ -544,24 +944,50 @@ static ObaInterpretResult run(ObaVM* vm) {
     CASE_OP(EQ) : {
       Value b = pop(vm);
       Value a = pop(vm);
-      push(vm, OBA_BOOL(valuesEqual(a, b)));
+      if (IS_NUMBER(a) && IS_NUMBER(b)) QUICKEN(EQ_NUM);
+      PUSH(OBA_BOOL(valuesEqual(a, b)));
+      DISPATCH();
+    }
+
+    CASE_OP(EQ_NUM) : {
+      Value b = pop(vm);
+      Value a = pop(vm);
+      if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        PUSH(OBA_BOOL(AS_NUMBER(a) == AS_NUMBER(b)));
+        DISPATCH();
+      }
+      QUICKEN(EQ);
+      PUSH(OBA_BOOL(valuesEqual(a, b)));
       DISPATCH();
     }
 
     CASE_OP(NEQ) : {
       Value b = pop(vm);
       Value a = pop(vm);
-      push(vm, OBA_BOOL(!valuesEqual(a, b)));
+      if (IS_NUMBER(a) && IS_NUMBER(b)) QUICKEN(NEQ_NUM);
+      PUSH(OBA_BOOL(!valuesEqual(a, b)));
+      DISPATCH();
+    }
+
+    CASE_OP(NEQ_NUM) : {
+      Value b = pop(vm);
+      Value a = pop(vm);
+      if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        PUSH(OBA_BOOL(AS_NUMBER(a) != AS_NUMBER(b)));
+        DISPATCH();
+      }
+      QUICKEN(NEQ);
+      PUSH(OBA_BOOL(!valuesEqual(a, b)));
       DISPATCH();
     }
 
     CASE_OP(TRUE) : {
-      push(vm, OBA_BOOL(true));
+      PUSH(OBA_BOOL(true));
       DISPATCH();
     }
 
     CASE_OP(FALSE) : {
-      push(vm, OBA_BOOL(false));
+      PUSH(OBA_BOOL(false));
       DISPATCH();
     }
 
@@ -594,53 +1020,111 @@ static ObaInterpretResult run(ObaVM* vm) {
       DISPATCH();
     }
 
+    CASE_OP(JUMP_IF_LOCAL_CMP_FALSE) : {
+      Value a = vm->frame->slots[READ_BYTE()];
+      Value b = READ_CONSTANT();
+      uint8_t comparison = READ_BYTE();
+      int jump = READ_SHORT();
+
+      bool cond;
+      if (!compareValues(vm, comparison, a, b, &cond)) RUNTIME_ERROR();
+      if (!cond) vm->frame->ip += jump;
+      DISPATCH();
+    }
+
+    CASE_OP(JUMP_IF_LOCALS_CMP_FALSE) : {
+      Value a = vm->frame->slots[READ_BYTE()];
+      Value b = vm->frame->slots[READ_BYTE()];
+      uint8_t comparison = READ_BYTE();
+      int jump = READ_SHORT();
+
+      bool cond;
+      if (!compareValues(vm, comparison, a, b, &cond)) RUNTIME_ERROR();
+      if (!cond) vm->frame->ip += jump;
+      DISPATCH();
+    }
+
+    CASE_OP(MATCH) : {
+      MatchTable* table =
+          &vm->frame->closure->function->chunk.matchTables.values[READ_SHORT()];
+      Value value = peek(vm, 1);
+
+      // Literals are found by their hash, which needs a flat string.
+      if (IS_STRING(value)) flattenString(vm, AS_STRING(value));
+      MatchArm* arm = selectArm(vm, table, value);
+      if (arm == NULL) DISPATCH();
+
+      // If the arm binds the wrong number of fields, let its pattern test
+      // report the error.
+      int fieldCount = IS_INSTANCE(value) ? AS_INSTANCE(value)->ctor->arity : 0;
+      if (arm->bindingCount != fieldCount) DISPATCH();
+
+      for (int i = 0; i < fieldCount; i++) {
+        PUSH(AS_INSTANCE(value)->fields[i]);
+      }
+      vm->frame->ip = vm->frame->closure->function->chunk.code + arm->body;
+      DISPATCH();
+    }
+
     CASE_OP(JUMP_IF_NOT_MATCH) : {
+      uint8_t bindingCount = READ_BYTE();
       int jump = READ_SHORT();
-      Value lambda = peek(vm, 1);
-      Value pattern = peek(vm, 2);
-      Value value = peek(vm, 3);
+      Value pattern = pop(vm);
+      Value value = peek(vm, 1);
 
       if (!match(vm, pattern, value)) {
         vm->frame->ip += jump;
-        pop(vm); // lambda.
-        pop(vm); // pattern.
         DISPATCH();
       }
-      pop(vm); // lambda.
-      pop(vm); // pattern.
-      pop(vm); // value.
-      push(vm, lambda);
+
+      // The arm's variables are bound to the value's fields, so there must be
+      // exactly as many of them as there are fields.
+      int fieldCount = IS_CTOR(pattern) ? AS_CTOR(pattern)->arity : 0;
+      if (bindingCount != fieldCount) {
+        obaArityError(vm, bindingCount, fieldCount);
+        RUNTIME_ERROR();
+      }
       destructure(vm, pattern, value);
       DISPATCH();
     }
 
+    CASE_OP(POP_UNDER) : {
+      // Removes the values below the top of the stack, such as the value a
+      // match arm matched and its fields, keeping the top one. Nothing can
+      // capture these values since they are never declared by a statement.
+      uint8_t count = READ_BYTE();
+      Value top = pop(vm);
+      vm->stackTop -= count;
+      PUSH(top);
+      DISPATCH();
+    }
+
     CASE_OP(LOOP) : {
-      vm->frame->ip = vm->frame->closure->function->chunk.code + READ_SHORT();
+      ObjFunction* function = vm->frame->closure->function;
+      vm->frame->ip = function->chunk.code + READ_SHORT();
+      warmUp(vm, function);
+      JIT_ENTER();
       DISPATCH();
     }
 
     CASE_OP(DEFINE_GLOBAL) : {
-      ObjString* name = READ_STRING();
-      obaPushRoot(vm, (Obj*)name);
-      tableSet(vm, vm->frame->closure->function->module->variables, name,
-               peek(vm, 1));
-      obaPopRoot(vm);
-      pop(vm);
+      ObjModule* module = vm->frame->closure->function->module;
+      module->variables.values[READ_BYTE()] = pop(vm);
+      WRITE_BARRIER(vm, module);
       DISPATCH();
     }
 
     CASE_OP(GET_GLOBAL) : {
-      ObjString* name = READ_STRING();
-      Value value;
+      ObjModule* module = vm->frame->closure->function->module;
+      uint8_t slot = READ_BYTE();
+      Value value = module->variables.values[slot];
 
-      if (!tableGet(vm->frame->closure->function->module->variables, name,
-                    &value)) {
-        if (!tableGet(vm->globals, name, &value)) {
-          obaErrorf(vm, "Undefined variable: %s", name->chars);
-          RUNTIME_ERROR();
-        }
+      if (IS_UNDEFINED(value)) {
+        obaErrorf(vm, "Undefined variable: %s",
+                  module->variableNames.values[slot]->chars);
+        RUNTIME_ERROR();
       }
-      push(vm, value);
+      PUSH(value);
       DISPATCH();
     }
 
@@ -661,16 +1145,34 @@ static ObaInterpretResult run(ObaVM* vm) {
       RUNTIME_ERROR();
     }
 
+    CASE_OP(STORE_LOCAL) : {
+      uint8_t slot = READ_BYTE();
+
+      Value oldValue = vm->frame->slots[slot];
+      Value newValue = pop(vm);
+      if (canAssignType(oldValue, newValue)) {
+        vm->frame->slots[slot] = newValue;
+        DISPATCH();
+      }
+
+      const char* oldTypeName = valueTypeName(oldValue);
+      const char* newTypeName = valueTypeName(newValue);
+      obaErrorf(vm, "Cannot assign '%s' to variable of type '%s'", newTypeName,
+                oldTypeName);
+      RUNTIME_ERROR();
+    }
+
     CASE_OP(GET_LOCAL) : {
       // Locals live on the top of the stack.
       uint8_t slot = READ_BYTE();
-      push(vm, vm->frame->slots[slot]);
+      PUSH(vm->frame->slots[slot]);
       DISPATCH();
     }
 
     CASE_OP(SET_UPVALUE) : {
-      uint8_t slot = READ_BYTE();
-      *vm->frame->closure->upvalues[slot]->location = peek(vm, 1);
+      ObjUpvalue* upvalue = vm->frame->closure->upvalues[READ_BYTE()];
+      *upvalue->location = peek(vm, 1);
+      WRITE_BARRIER(vm, upvalue);
       DISPATCH();
     }
 
@@ -679,7 +1181,7 @@ static ObaInterpretResult run(ObaVM* vm) {
       ObjUpvalue* upvalue = vm->frame->closure->upvalues[slot];
       // The user can never get an upvalue directly. Push its captured value
       // onto the stack instead.
-      push(vm, *upvalue->location);
+      PUSH(*upvalue->location);
       DISPATCH();
     }
 
@@ -698,19 +1200,37 @@ static ObaInterpretResult run(ObaVM* vm) {
 
       ObjModule* module = AS_MODULE(receiver);
       ObjString* name = READ_STRING();
-      Value value;
-      if (!tableGet(module->variables, name, &value)) {
+      ImportCacheBuffer* caches =
+          &vm->frame->closure->function->chunk.importCaches;
+      ImportCache* cache = &caches->values[READ_SHORT()];
+
+      if (cache->module != module) {
+        int slot = findModuleVariable(module, name);
+        if (slot < 0) {
+          obaErrorf(vm, "Variable '%s' not found in module '%s'", name->chars,
+                    module->name->chars);
+          RUNTIME_ERROR();
+        }
+        cache->module = module;
+        cache->slot = slot;
+        WRITE_BARRIER(vm, vm->frame->closure->function);
+      }
+
+      Value value = module->variables.values[cache->slot];
+      if (IS_UNDEFINED(value)) {
         obaErrorf(vm, "Variable '%s' not found in module '%s'", name->chars,
-                  module->name);
+                  module->name->chars);
         RUNTIME_ERROR();
       }
-      push(vm, value);
+      PUSH(value);
       DISPATCH();
     }
 
-    CASE_OP(STRING) : {
-      Value string = OBJ_VAL(formatValue(vm, pop(vm)));
-      push(vm, string);
+    CASE_OP(BUILD_STRING) : {
+      uint8_t count = READ_BYTE();
+      ObjString* string = buildString(vm, vm->stackTop - count, count);
+      vm->stackTop -= count;
+      PUSH(OBJ_VAL(string));
       DISPATCH();
     }
 
@@ -719,13 +1239,23 @@ static ObaInterpretResult run(ObaVM* vm) {
       if (!callValue(vm, peek(vm, argCount + 1), argCount)) {
         RUNTIME_ERROR();
       }
+      JIT_ENTER();
+      DISPATCH();
+    }
+
+    CASE_OP(TAIL_CALL) : {
+      uint8_t argCount = READ_BYTE();
+      if (!tailCall(vm, argCount)) {
+        RUNTIME_ERROR();
+      }
+      JIT_ENTER();
       DISPATCH();
     }
 
     CASE_OP(CLOSURE) : {
       ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
       ObjClosure* closure = newClosure(vm, function);
-      push(vm, OBJ_VAL(closure));
+      PUSH(OBJ_VAL(closure));
 
       for (int j = 0; j < closure->upvalueCount; j++) {
         uint8_t isLocal = READ_BYTE();
@@ -736,11 +1266,17 @@ static ObaInterpretResult run(ObaVM* vm) {
           closure->upvalues[j] = vm->frame->closure->upvalues[slot];
         }
       }
+
+      // Capturing an upvalue allocates, which may have run a young collection
+      // that promoted the closure to the old generation, so the stores into
+      // its upvalues need the barrier.
+      WRITE_BARRIER(vm, closure);
       DISPATCH();
     }
 
     CASE_OP(RETURN) : {
       return_(vm);
+      JIT_ENTER();
       DISPATCH();
     }
 
@@ -749,10 +1285,15 @@ static ObaInterpretResult run(ObaVM* vm) {
       DISPATCH();
     }
 
+    CASE_OP(POPN) : {
+      vm->stackTop -= READ_BYTE();
+      DISPATCH();
+    }
+
     CASE_OP(DEBUG) : {
       Value value = pop(vm);
-      printValue(value);
-      printf("\n");
+      obaWriteValue(vm, value);
+      obaWriteNewline(vm);
       DISPATCH();
     }
 
@@ -767,7 +1308,7 @@ static ObaInterpretResult run(ObaVM* vm) {
 
     CASE_OP(END_MODULE) : {
       // Don't pop the root module or we'll never reach OP_EXIT.
-      push(vm, NIL_VAL);
+      PUSH(NIL_VAL);
       if (vm->frame - vm->frames > 1) {
         return_(vm);
         pop(vm);
@@ -783,15 +1324,22 @@ static ObaInterpretResult run(ObaVM* vm) {
     }
   }
 
+#undef PUSH
 #undef READ_BYTE
 #undef READ_SHORT
 #undef READ_CONSTANT
 #undef READ_STRING
 #undef BINARY_OP
+#undef QUICKEN
+#undef ADD_OP
+#undef REGISTER_OP
+#undef REGISTER_ADD_OP
+#undef REGISTER_MODULO_OP
 #undef CASE_OP
 #undef DISPATCH
 #undef INTERPRET_LOOP
 #undef DEBUG_TRACE_INSTRUCTIONS
+#undef JIT_ENTER
 }
 
 void obaPushRoot(ObaVM* vm, Obj* obj) {
@@ -814,8 +1362,11 @@ static void markRoots(ObaVM* vm) {
     obaGrayObject(vm, vm->tempRoots[i]);
   }
 
-  for (CallFrame* frame = vm->frames; frame <= vm->frame; frame++) {
-    obaGrayObject(vm, (Obj*)frame->closure);
+  // The frames are still unallocated while the VM is being created.
+  if (vm->frames != NULL) {
+    for (CallFrame* frame = vm->frames; frame <= vm->frame; frame++) {
+      obaGrayObject(vm, (Obj*)frame->closure);
+    }
   }
 
   for (ObjUpvalue* uv = vm->openUpvalues; uv != NULL; uv = uv->next) {
@@ -823,59 +1374,321 @@ static void markRoots(ObaVM* vm) {
   }
 
   obaGrayTable(vm, vm->globals);
-  obaGrayTable(vm, vm->strings);
   obaGrayValue(vm, vm->error);
   markCompilerRoots(vm, vm->compiler);
 }
 
-static void blackenRoots(ObaVM* vm) {
-  while (vm->grayCount > 0) {
-    Obj* obj = vm->grayStack[--vm->grayCount];
-    blackenObject(vm, obj);
+// Marks the young objects that remembered objects refer to.
+static void markRemembered(ObaVM* vm) {
+  // Remembered objects are old and already marked, so graying them would do
+  // nothing. Their references are followed directly instead.
+  for (int i = 0; i < vm->rememberedCount; i++) {
+    blackenObject(&vm->gray, vm->remembered[i]);
   }
 }
 
-static void sweepGarbage(ObaVM* vm) {
-  Obj* previous = NULL;
-  Obj* object = vm->objects;
-  while (object != NULL) {
-    if (object->isMarked) {
-      object->isMarked = false;
-      previous = object;
-      object = object->next;
+// Empties the remembered set. After a collection every surviving object is
+// old, so no old object refers to a young one.
+static void forgetRemembered(ObaVM* vm) {
+  for (int i = 0; i < vm->rememberedCount; i++) {
+    vm->remembered[i]->isRemembered = false;
+  }
+  vm->rememberedCount = 0;
+}
+
+// Removes the strings interned since the last young collection from the string
+// table, if they were not marked. Older strings are only removed by full
+// collections.
+static void removeWhiteYoungStrings(ObaVM* vm) {
+  for (int i = 0; i < vm->youngStringCount; i++) {
+    ObjString* string = vm->youngStrings[i];
+    if (!IS_MARKED(vm, &string->obj)) tableDelete(vm->strings, string);
+  }
+  vm->youngStringCount = 0;
+}
+
+// Blackens up to [budget] objects from the gray stack. Once there are enough
+// gray objects to share, the rest of the work is split across the markers.
+static void blackenGray(ObaVM* vm, int budget) {
+  while (budget > 0 && vm->gray.count > 0) {
+    if (vm->markers.count > 1 && vm->gray.count >= PARALLEL_MARK_MIN) {
+      budget -= markInParallel(&vm->markers, &vm->gray, budget);
       continue;
     }
 
-    Obj* unreached = object;
-    object = object->next;
-    if (previous != NULL) {
-      previous->next = object;
+    Obj* obj = vm->gray.objects[--vm->gray.count];
+    // The barrier may push the object again after this.
+    obj->isRemembered = false;
+    blackenObject(&vm->gray, obj);
+    budget--;
+  }
+}
+
+static void blackenRoots(ObaVM* vm) { blackenGray(vm, INT_MAX); }
+
+// Frees the unmarked objects in the young generation and promotes the rest to
+// the old generation. Promoted objects stay marked.
+//
+// Both lists run from the newest object to the oldest, which freeObject relies
+// on, so the survivors are linked in front of the old generation in order.
+static void sweepYoung(ObaVM* vm) {
+  Obj* survivors = NULL;
+  Obj** tail = &survivors;
+
+  Obj* object = vm->objects;
+  while (object != NULL) {
+    Obj* next = object->next;
+    if (IS_MARKED(vm, object)) {
+      *tail = object;
+      tail = &object->next;
     } else {
-      vm->objects = object;
+      freeObject(vm, object);
     }
-    freeObject(vm, unreached);
+    object = next;
   }
+
+  *tail = vm->oldObjects;
+  vm->oldObjects = survivors;
+  vm->objects = NULL;
 }
 
-// VM public API implementation ------------------------------------------------
+static void collectYoung(ObaVM* vm) {
+#ifdef DEBUG_LOG_GC
+  printf("-- young gc begin\n");
+  size_t before = vm->bytesAllocated;
+#endif
+  // Old objects are already marked, so marking stops at them and only the
+  // young objects reachable from the roots and the remembered set are traced.
+  markRoots(vm);
+  markRemembered(vm);
+  blackenRoots(vm);
+  forgetRemembered(vm);
+
+  removeWhiteYoungStrings(vm);
+  sweepYoung(vm);
+  vm->nextYoungGC = vm->bytesAllocated + GC_NURSERY_SIZE;
+  vm->youngCollections++;
 
-void obaCollectGarbage(ObaVM* vm) {
+#ifdef DEBUG_LOG_GC
+  printf("-- young gc end\n");
+  printf("   collected %ld bytes (from %ld to %ld)\n",
+         before - vm->bytesAllocated, before, vm->bytesAllocated);
+#endif
+}
+
+static void startFullCollection(ObaVM* vm) {
 #ifdef DEBUG_LOG_GC
   printf("-- gc begin\n");
-  size_t before = vm->bytesAllocated;
 #endif
+  // Promoting the young generation leaves every object old and marked, so
+  // flipping the color unmarks all of them.
+  collectYoung(vm);
+  vm->markColor = !vm->markColor;
+  vm->gcPhase = GC_MARK;
+  markRoots(vm);
+}
+
+static void finishMarking(ObaVM* vm) {
+  // Stores into the roots don't go through the write barrier, so the roots
+  // are marked again. This is the only part of marking that can't be sliced.
   markRoots(vm);
   blackenRoots(vm);
-  sweepGarbage(vm);
+
+  // The string table doesn't keep strings alive. Strings that nothing else
+  // refers to are removed from it before they are freed.
+  tableRemoveWhite(vm, vm->strings);
+  vm->youngStringCount = 0;
+
+  // Everything allocated while marking was marked, so this only promotes it.
+  sweepYoung(vm);
+  vm->sweep = &vm->oldObjects;
+  vm->gcPhase = GC_SWEEP;
+}
+
+// Frees unmarked old objects until [budget] objects have been swept.
+static void sweepOld(ObaVM* vm, int budget) {
+  for (; budget > 0 && *vm->sweep != NULL; budget--) {
+    Obj* object = *vm->sweep;
+    if (IS_MARKED(vm, object)) {
+      vm->sweep = &object->next;
+    } else {
+      *vm->sweep = object->next;
+      freeObject(vm, object);
+    }
+  }
+
+  if (*vm->sweep != NULL) return;
+
+  vm->sweep = NULL;
+  vm->gcPhase = GC_IDLE;
   vm->nextGC = vm->bytesAllocated * GC_HEAP_GROW_FACTOR;
+  vm->youngCollections = 0;
 
 #ifdef DEBUG_LOG_GC
   printf("-- gc end\n");
-  printf("   collected %ld bytes (from %ld to %ld) next at %ld\n",
-         before - vm->bytesAllocated, before, vm->bytesAllocated, vm->nextGC);
+  printf("   heap is %ld bytes, next at %ld\n", vm->bytesAllocated,
+         vm->nextGC);
 #endif
 }
 
+// Runs the rest of the current full collection without slicing it.
+static void finishFullCollection(ObaVM* vm) {
+  if (vm->gcPhase == GC_MARK) {
+    blackenRoots(vm);
+    finishMarking(vm);
+  }
+  if (vm->gcPhase == GC_SWEEP) sweepOld(vm, INT_MAX);
+}
+
+// Sets the heap size at which the next collection work is due.
+static void scheduleGarbageStep(ObaVM* vm) {
+  switch (vm->gcPhase) {
+  case GC_IDLE:
+    vm->nextGCStep =
+        vm->nextGC < vm->nextYoungGC ? vm->nextGC : vm->nextYoungGC;
+    break;
+  case GC_MARK:
+    vm->nextGCStep = vm->bytesAllocated + GC_SLICE_SIZE;
+    break;
+  case GC_SWEEP:
+    vm->nextGCStep = vm->bytesAllocated + GC_SLICE_SIZE;
+    if (vm->nextYoungGC < vm->nextGCStep) vm->nextGCStep = vm->nextYoungGC;
+    break;
+  }
+}
+
+void obaStepGarbage(ObaVM* vm) {
+#ifdef DEBUG_STRESS_GC
+  bool fullDue = vm->youngCollections + 1 >= GC_STRESS_FULL_INTERVAL;
+  bool youngDue = true;
+  bool heapFull = false;
+#else
+  bool fullDue = vm->bytesAllocated > vm->nextGC;
+  bool youngDue = vm->bytesAllocated > vm->nextYoungGC;
+  // If the mutator allocates faster than the slices mark, the heap could grow
+  // without bound, so the collection is finished at once instead.
+  bool heapFull = vm->bytesAllocated > vm->nextGC * GC_HEAP_GROW_FACTOR;
+#endif
+
+  switch (vm->gcPhase) {
+  case GC_IDLE:
+    if (fullDue) {
+      startFullCollection(vm);
+    } else {
+      collectYoung(vm);
+    }
+    break;
+
+  case GC_MARK:
+    // Young collections would unmark the objects marked so far, so the young
+    // generation grows until marking ends.
+    if (heapFull) {
+      finishFullCollection(vm);
+      break;
+    }
+    blackenGray(vm, vm->gcSliceBudget);
+    if (vm->gray.count == 0) finishMarking(vm);
+    break;
+
+  case GC_SWEEP:
+    // Young collections only promote marked objects to the old generation,
+    // which the sweep keeps.
+    if (youngDue) collectYoung(vm);
+    sweepOld(vm, vm->gcSliceBudget);
+    break;
+  }
+
+  scheduleGarbageStep(vm);
+}
+
+void obaRemember(ObaVM* vm, Obj* obj) {
+  obj->isRemembered = true;
+
+  // While marking, the object may have been blackened before the store, so it
+  // is traced again.
+  if (vm->gcPhase == GC_MARK) {
+    obaPushGray(vm, obj);
+    return;
+  }
+
+  if (vm->rememberedCount + 1 > vm->rememberedCapacity) {
+    vm->rememberedCapacity = GROW_CAPACITY(vm->rememberedCapacity);
+    // Use realloc directly, since a barrier must never trigger a GC.
+    vm->remembered =
+        realloc(vm->remembered, sizeof(Obj*) * vm->rememberedCapacity);
+    if (vm->remembered == NULL) exit(1);
+  }
+  vm->remembered[vm->rememberedCount++] = obj;
+}
+
+void obaAddYoungString(ObaVM* vm, ObjString* string) {
+  if (vm->youngStringCount + 1 > vm->youngStringCapacity) {
+    vm->youngStringCapacity = GROW_CAPACITY(vm->youngStringCapacity);
+    // Use realloc directly, so recording a string never triggers a GC.
+    vm->youngStrings = realloc(vm->youngStrings, sizeof(ObjString*) *
+                                                     vm->youngStringCapacity);
+    if (vm->youngStrings == NULL) exit(1);
+  }
+  vm->youngStrings[vm->youngStringCount++] = string;
+}
+
+// VM public API implementation ------------------------------------------------
+
+void obaCollectGarbage(ObaVM* vm) {
+  if (vm->gcPhase != GC_IDLE) finishFullCollection(vm);
+  startFullCollection(vm);
+  finishFullCollection(vm);
+  scheduleGarbageStep(vm);
+}
+
+void obaSetMaxFrames(ObaVM* vm, int maxFrames) {
+  vm->maxFrames = maxFrames < 2 ? 2 : maxFrames;
+}
+
+void obaSetGCSliceBudget(ObaVM* vm, int objects) {
+  vm->gcSliceBudget = objects < 1 ? 1 : objects;
+}
+
+void obaSetMarkerThreads(ObaVM* vm, int threads) {
+  setMarkerCount(&vm->markers, threads);
+}
+
+void obaEnableJit(ObaVM* vm, bool enabled) { vm->jitEnabled = enabled; }
+
+void obaEnablePerfMap(ObaVM* vm, bool enabled) {
+  vm->perfMapEnabled = enabled;
+}
+
+void obaWriteValue(ObaVM* vm, Value value) {
+  writeValue(&vm->output, value);
+  if (vm->output.count >= OUTPUT_BUFFER_SIZE) obaFlushOutput(vm);
+}
+
+void obaWriteNewline(ObaVM* vm) {
+  writeBytes(&vm->output, "\n", 1);
+  if (vm->outputIsTerminal || vm->output.count >= OUTPUT_BUFFER_SIZE) {
+    obaFlushOutput(vm);
+  }
+}
+
+void obaFlushOutput(ObaVM* vm) {
+  // Anything the host printed through stdio came first.
+  fflush(stdout);
+
+  uint8_t* bytes = vm->output.values;
+  int remaining = vm->output.count;
+  while (remaining > 0) {
+    ssize_t written = write(STDOUT_FILENO, bytes, remaining);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      break; // The output is lost, as it would be with stdio.
+    }
+    bytes += written;
+    remaining -= (int)written;
+  }
+  vm->output.count = 0;
+}
+
 void obaErrorf(ObaVM* vm, const char* format, ...) {
   char buf[MAX_ERROR_SIZE];
 
@@ -907,40 +1720,79 @@ ObaVM* obaNewVM(Builtin* builtins, int builtinsLength) {
   vm->openUpvalues = NULL;
 
   vm->objects = NULL;
-  vm->grayCount = 0;
-  vm->grayCapacity = 0;
-  vm->grayStack = NULL;
+  vm->oldObjects = NULL;
+  vm->rememberedCount = 0;
+  vm->rememberedCapacity = 0;
+  vm->remembered = NULL;
+  vm->youngStringCount = 0;
+  vm->youngStringCapacity = 0;
+  vm->youngStrings = NULL;
+  initGrayStack(&vm->gray, vm);
+  initMarkerPool(&vm->markers, vm);
   vm->tempRootsCount = 0;
   vm->bytesAllocated = 0;
   vm->nextGC = 1024 * 1024;
+  vm->nextYoungGC = GC_NURSERY_SIZE;
+  vm->nextGCStep = GC_NURSERY_SIZE;
+  vm->youngCollections = 0;
+  vm->gcPhase = GC_IDLE;
+  vm->markColor = true;
+  vm->sweep = NULL;
+  vm->gcSliceBudget = GC_SLICE_BUDGET;
+  initAllocator(&vm->allocator);
 
   resetStack(vm);
   vm->stack = NULL;
   vm->stackCapacity = 0;
 
-  vm->frame = vm->frames;
+  vm->frames = NULL;
+  vm->frame = NULL;
+  vm->frameCapacity = 0;
+  vm->maxFrames = FRAMES_MAX;
 
   vm->error = NIL_VAL;
 
+  vm->jitEnabled = true;
+  vm->perfMapEnabled = false;
+  vm->perfMap = NULL;
+
+  initByteBuffer(&vm->output);
+  vm->outputIsTerminal = isatty(STDOUT_FILENO);
+
   vm->globals = (Table*)realloc(NULL, sizeof(Table));
   initTable(vm->globals);
 
   vm->strings = (Table*)realloc(NULL, sizeof(Table));
   initTable(vm->strings);
 
+  // The first frame is a sentinel below the frame of the root module.
+  ensureFrames(vm, MIN_FRAMES_CAPACITY);
+  vm->frame->closure = NULL;
+  vm->frame->ip = NULL;
+  vm->frame->slots = NULL;
+
   registerBuiltins(vm, builtins, builtinsLength);
   return vm;
 }
 
 void obaFreeVM(ObaVM* vm) {
+  obaFlushOutput(vm);
+  freeFormatBuffer(&vm->output);
+
   // Any non-object values held in object fields will be freed by this.
   freeObjects(vm);
   FREE_ARRAY(vm, Value, vm->stack, vm->stackCapacity);
+  FREE_ARRAY(vm, CallFrame, vm->frames, vm->frameCapacity);
   freeTable(vm, vm->globals);
   free(vm->globals);
   freeTable(vm, vm->strings);
   free(vm->strings);
-  free(vm->grayStack);
+  freeGrayStack(&vm->gray);
+  freeMarkerPool(&vm->markers);
+  free(vm->remembered);
+  free(vm->youngStrings);
+  if (vm->perfMap != NULL) fclose(vm->perfMap);
+  freeAllocator(&vm->allocator);
   free(vm);
 }
 
@@ -970,5 +1822,7 @@ ObaInterpretResult obaInterpret(ObaVM* vm, const char* source) {
   vm->allowGlobals = true;
   interpret(vm, obaGlobalsModSource());
   vm->allowGlobals = false;
-  return interpret(vm, source);
+  ObaInterpretResult result = interpret(vm, source);
+  obaFlushOutput(vm);
+  return result;
 }
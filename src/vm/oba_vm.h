@@ -1,17 +1,22 @@
 #ifndef oba_vm_h
 #define oba_vm_h
 
+#include <stdio.h>
+
+#include "oba_allocator.h"
 #include "oba_compiler.h"
 #include "oba_function.h"
+#include "oba_marker.h"
 #include "oba_token.h"
 #include "oba_value.h"
 
 // The maximum number of values that can be held on the stack at once.
 #define MIN_STACK_CAPACITY 1024
 
-// The maximum number of call-frames.
-// TODO(kendal): Oba code will naturally have many recursive calls, the call
-// frameStack should be dynamic.
+// The number of call-frames allocated when the VM is created.
+#define MIN_FRAMES_CAPACITY 64
+
+// The default maximum number of nested call-frames.
 #define FRAMES_MAX 1024 * 1024
 
 // The maximum number of temporary GC roots at any given time. In practice there
@@ -20,8 +25,46 @@
 
 #define GC_HEAP_GROW_FACTOR 2
 
+// The number of bytes allocated between young collections.
+#define GC_NURSERY_SIZE (256 * 1024)
+
+// Under DEBUG_STRESS_GC, every allocation does some collection work, and every
+// this many young collections are followed by a full collection.
+#define GC_STRESS_FULL_INTERVAL 16
+
+// The number of bytes allocated between slices of a full collection.
+#define GC_SLICE_SIZE (64 * 1024)
+
+// The default number of objects that a slice of a full collection marks or
+// sweeps.
+#ifdef DEBUG_STRESS_GC
+#define GC_SLICE_BUDGET 8
+#else
+#define GC_SLICE_BUDGET 10000
+#endif
+
+// The phases of a full collection.
+typedef enum {
+  // No full collection is running.
+  GC_IDLE,
+
+  // Marking runs in slices between allocations. Stores into marked objects
+  // push them back onto the gray stack, and the roots are marked again before
+  // marking ends.
+  GC_MARK,
+
+  // Sweeping the old generation runs in slices between allocations.
+  GC_SWEEP,
+} GCPhase;
+
+// The number of bytes of output the VM buffers before writing them to stdout.
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+
 struct ObaVM {
-  CallFrame frames[FRAMES_MAX];
+  // The call-frame stack. This grows as needed up to [maxFrames] frames.
+  int frameCapacity;
+  int maxFrames;
+  CallFrame* frames;
   CallFrame* frame;
 
   struct Compiler* compiler;
@@ -32,29 +75,93 @@ struct ObaVM {
 
   // Global values available to all modules.
   //
-  // Builtins are defined here. When searching for a global, the VM first checks
-  // the current module, then this table.
+  // Builtins are defined here. The compiler links a builtin into a module's
+  // variables the first time the module refers to it, so this table is only
+  // searched at compile time.
   Table* globals;
   Table* strings;
 
   ObjUpvalue* openUpvalues;
+
+  // The young generation: objects allocated since the last collection.
   Obj* objects;
 
+  // The old generation: objects that survived a collection. These are only
+  // freed by full collections.
+  Obj* oldObjects;
+
+  // Old objects that may refer to young objects. A young collection treats
+  // them as roots, so it never has to trace the rest of the old generation.
+  int rememberedCount;
+  int rememberedCapacity;
+  Obj** remembered;
+
+  // The strings interned since the last young collection. A young collection
+  // only has to remove these from the string table, instead of every string.
+  int youngStringCount;
+  int youngStringCapacity;
+  ObjString** youngStrings;
+
   // Set by Oba code when a panic occurs. When set, the VM prints the error, a
   // stacktrace, and exits on the next turn.
   Value error;
 
+  // Output written by Oba code that has not been written to stdout yet. It is
+  // written when the buffer fills up, at the end of every line if stdout is a
+  // terminal, and when the VM stops running or reads input. The buffer is not
+  // tracked by the GC.
+  ByteBuffer output;
+  bool outputIsTerminal;
+
   // Whether the current module can define new global variables. This is used
   // internally and is automatically disabled for user code.
   bool allowGlobals;
 
-  // Fields that keep of "gray" objects during GC.
-  int grayCount;
-  int grayCapacity;
-  Obj** grayStack;
+  // Whether hot functions are compiled to machine code. This has no effect
+  // unless the VM was built with OBA_JIT.
+  bool jitEnabled;
+
+  // Whether the JIT records the code it generates in /tmp/perf-<pid>.map.
+  // The file is opened when the first function is compiled.
+  bool perfMapEnabled;
+  FILE* perfMap;
+
+  // Serves the small allocations made through [reallocate].
+  Allocator allocator;
+
+  // Objects that the current collection has marked but not traced yet.
+  GrayStack gray;
+
+  // The threads that trace the gray objects when there are many of them.
+  MarkerPool markers;
   size_t bytesAllocated;
+
+  // The heap size at which the next full collection runs.
   size_t nextGC;
 
+  // The heap size at which the next young collection runs.
+  size_t nextYoungGC;
+
+  // The heap size at which the next collection work is done: a young
+  // collection, the start of a full collection, or a slice of one.
+  size_t nextGCStep;
+
+  // The number of young collections since the last full collection.
+  int youngCollections;
+
+  // The phase of the running full collection.
+  GCPhase gcPhase;
+
+  // The value of [Obj.mark] for marked objects. Flipping it unmarks every
+  // object at once.
+  bool markColor;
+
+  // The link to the next old object to sweep.
+  Obj** sweep;
+
+  // The number of objects that a slice of a full collection marks or sweeps.
+  int gcSliceBudget;
+
   // Temporary GC roots. These are used to prevent heap objects from being GC'd
   // while they're being initialized - for example if they contain nested heap
   // objects that also require allocation and may trigger GC.
@@ -63,7 +170,7 @@ struct ObaVM {
 };
 
 typedef enum {
-#define OPCODE(name) OP_##name,
+#define OPCODE(name, _) OP_##name,
 #include "oba_opcodes.h"
 #undef OPCODE
 } OpCode;
@@ -71,4 +178,32 @@ typedef enum {
 void obaPopRoot(ObaVM*);
 void obaPushRoot(ObaVM*, Obj*);
 
+#define IS_MARKED(vm, obj) ((obj)->mark == (vm)->markColor)
+
+// Does the collection work that is due after an allocation: a young
+// collection, or the start or a slice of a full collection.
+void obaStepGarbage(ObaVM*);
+
+// Records a store into the marked object [obj]. Use WRITE_BARRIER instead.
+void obaRemember(ObaVM*, Obj*);
+
+// Records that [string] was just added to the string table.
+void obaAddYoungString(ObaVM*, ObjString* string);
+
+// Must follow every store of a value into [object] after the object was
+// allocated, unless nothing was allocated in between. If the object is marked,
+// it is remembered so the next young collection finds the young objects that
+// it refers to, or, while a full collection is marking, it is traced again.
+#define WRITE_BARRIER(vm, object)                                              \
+  do {                                                                         \
+    Obj* obj_ = (Obj*)(object);                                                \
+    if (IS_MARKED(vm, obj_) && !obj_->isRemembered) obaRemember(vm, obj_);     \
+  } while (false)
+
+// Appends the text of [value] to the VM's output.
+void obaWriteValue(ObaVM* vm, Value value);
+
+// Ends the current line of the VM's output.
+void obaWriteNewline(ObaVM* vm);
+
 #endif
@@ -10,6 +10,7 @@ TEST_DIR = "test"
 
 SKIP_RE = re.compile("// !skip")
 STDIN_RE = re.compile("// stdin: ?(.*)")
+ARGS_RE = re.compile("// args: ?(.*)")
 EXPECT_OUTPUT_RE = re.compile("// expect: ?(.*)")
 EXPECT_RUNTIME_ERROR_RE = re.compile("// expect runtime error: ?(.*)")
 EXPECT_COMPILE_ERROR_RE = re.compile("// expect compile error: ?(.*)")
@@ -61,6 +62,7 @@ def run_test(oba, test_file):
     expected_outs = []
     expected_errs = []
     stdin = ""
+    args = []
 
     # Parse the test expectations.
     with open(test_file, "r") as f:
@@ -73,6 +75,10 @@ def run_test(oba, test_file):
             if match:
                 stdin += match.group(1) + "\n"
 
+            match = ARGS_RE.search(line)
+            if match:
+                args += match.group(1).split()
+
             match = EXPECT_OUTPUT_RE.search(line)
             if match:
                 expected_outs.append(match.group(1))
@@ -91,7 +97,7 @@ def run_test(oba, test_file):
         raise TestError("Test has no expectations")
 
     # Get the test output.
-    test_args = [oba, test_file]
+    test_args = [oba] + args + [test_file]
     proc = Popen(test_args, stdin=PIPE, stderr=PIPE, stdout=PIPE)
     stdout, stderr = proc.communicate(input=stdin.encode())
 